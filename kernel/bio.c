@@ -111,6 +111,26 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Is the block in the cache with its contents read, so that
+// bread() of it needs no disk I/O? Only a hint: the buffer
+// may be recycled just after.
+int
+bcached(uint dev, uint blockno)
+{
+  struct buf *b;
+  int r = 0;
+
+  acquire(&bcache.lock);
+  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno){
+      r = b->valid;
+      break;
+    }
+  }
+  release(&bcache.lock);
+  return r;
+}
+
 // Release a locked buffer.
 // Move to the head of the most-recently-used list.
 void
@@ -2,11 +2,15 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kcache;
+struct memstat;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
+struct vma;
+struct shm;
 struct superblock;
 
 // bio.c
@@ -16,6 +20,7 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcached(uint, uint);
 
 // console.c
 void            consoleinit(void);
@@ -43,16 +48,22 @@ struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
+struct inode*   itextdup(struct inode*);
+void            itextput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
+int             iwmapdup(struct inode*);
+void            iwmapput(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+int             readblocks(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+int             icached(struct inode*, uint, uint);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -62,7 +73,21 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
+void*           kalloc_zeroed(void);
+void            kzerofill(void);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+int             korder(void *);
+void*           kalloc_split(int);
+void            kfree_split(void *, int);
+void            ksetclass(void *, int);
+int             kgetclass(void *);
+void            kmemstat(struct memstat*);
+void            kfreebatch(void **, int);
+void            kref(void *);
+int             krefcnt(void *);
 void            kinit(void);
+void            kallocdump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -70,7 +95,15 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// pcache.c
+void            pcacheinit(void);
+char*           pcacheget(struct inode*, uint, int);
+void            pcachewrite(struct inode*, uint, char*, uint);
+void            pcachedrop(struct inode*);
+int             pcachereclaim(int);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -86,7 +119,6 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -105,10 +137,22 @@ void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             memstat(uint64, uint64, int);
+uint64          procsatp(struct proc*);
+void            proctlbflush(pagetable_t, uint64*, int);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// swap.c
+void            swapinit(void);
+void            swapdup(int);
+void            swapfree(int);
+int             swapreclaim(int);
+int             swapin(pte_t*);
+void*           kalloc_user(int, int);
+void            swapstat(struct memstat*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -117,6 +161,16 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            slabinit(void);
+struct kcache*  kcache_create(char*, uint, int);
+void*           kcache_alloc(struct kcache*);
+void            kcache_free(struct kcache*, void*);
+int             kcachereclaim(void);
+void            kcachedump(void);
+void*           kmalloc(uint);
+void            kmfree(void*);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -146,7 +200,8 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
-int             findvma(uint64);
+int             pagefault(pagetable_t, uint64, int);
+
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
@@ -154,11 +209,41 @@ void            uartputc(int);
 void            uartputc_sync(int);
 int             uartgetc(void);
 
+// vma.c
+void            vmainit(void);
+struct vma*     vmaalloc(void);
+void            vmadup(struct vma*);
+void            vmaclose(struct vma*);
+void            vmainsert(struct proc*, struct vma*);
+void            vmaremove(struct proc*, struct vma*);
+struct vma*     vmaafter(struct proc*, uint64);
+struct vma*     vmafind(struct proc*, uint64);
+struct vma*     vmaoverlap(struct proc*, uint64, uint64);
+uint64          vmaplace(struct proc*, uint64);
+int             vmacopy(struct proc*, struct proc*);
+int             vmasplit(struct proc*, struct vma*, uint64);
+int             vmaunmap(struct proc*, uint64, uint64);
+void            vmaprefault(struct proc*, uint64, uint64, int);
+void            vmadrop(struct proc*, struct vma*, uint64, uint64);
+void            vmaprefetch(struct vma*, uint64, uint64);
+void            vmasync(struct proc*, struct vma*, uint64, uint64);
+void            vmafree(struct proc*, pagetable_t);
+struct shm*     shmalloc(uint);
+char*           shmpage(struct shm*, uint);
+
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+pte_t*          walk(pagetable_t, uint64, int);
+pte_t*          walkleaf(pagetable_t, uint64, uint64*);
+int             megamap(pagetable_t, uint64, int);
+int             megasplit(pte_t*, pagetable_t);
+pagetable_t     kvmcreate(void);
+void            kvmfree(pagetable_t);
+int             kvmsync(pagetable_t, pagetable_t, uint64);
+void            kvmresync(pagetable_t, pagetable_t);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
@@ -167,12 +252,26 @@ int             uvmcopy(pagetable_t, pagetable_t, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+uint64          uvmrss(pagetable_t);
+int             uvmrange(uint64, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
-int             mmapcopy(pagetable_t old, pagetable_t new, uint64 sz);
-void            mmapunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free);
+int             mmapcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow);
+int             cowfault(pagetable_t, uint64);
+int             uvmwalk(pagetable_t, uint64);
+int             zeromap(pagetable_t, uint64, int);
+int             mmapunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free);
+
+// vmcopyin.c
+int             copyout_new(pagetable_t, uint64, char *, uint64);
+int             copyin_new(pagetable_t, char *, uint64, uint64);
+int             copyinstr_new(pagetable_t, char *, uint64, uint64);
+
+// ucopy.S
+int             ucopy(void *, const void *, uint64);
+int             ucopystr(char *, const char *, uint64);
 
 // plic.c
 void            plicinit(void);
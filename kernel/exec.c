@@ -6,18 +6,25 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+#define NSEG 4  // loadable segments in a program
+
+// The program's segments are not read in here. Each becomes
+// a region in p->vmas that refers to the executable's
+// inode, and pagefault() reads a page of it in, or zero-fills
+// a page of bss, when the program first touches the page.
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma *seg[NSEG], *v;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -38,7 +45,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Find the program's segments.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,15 +55,33 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr % PGSIZE != 0 || ph.vaddr < sz)
       goto bad;
-    sz = sz1;
-    if(ph.vaddr % PGSIZE != 0)
+    if(ph.vaddr + ph.memsz > UMAXVA || ph.off + ph.filesz < ph.off)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(nseg == NSEG || (v = vmaalloc()) == 0)
       goto bad;
+    seg[nseg++] = v;
+    v->st = ph.vaddr;
+    v->ed = PGROUNDUP(ph.vaddr + ph.memsz);
+    v->length = ph.memsz;
+    v->offset = ph.off;
+    v->filesz = ph.filesz;
+    v->prot = 0;
+    if(ph.flags & ELF_PROG_FLAG_READ)
+      v->prot |= PROT_READ;
+    if(ph.flags & ELF_PROG_FLAG_WRITE)
+      v->prot |= PROT_WRITE;
+    if(ph.flags & ELF_PROG_FLAG_EXEC)
+      v->prot |= PROT_EXEC;
+    sz = ph.vaddr + ph.memsz;
   }
+  // the segments keep references to ip, taken while it is
+  // locked so that no write() to it is half done. a program
+  // that some process maps writable and shared can't run.
+  for(i = 0; i < nseg; i++)
+    if((seg[i]->ip = itextdup(ip)) == 0)
+      goto bad;
   iunlockput(ip);
   end_op();
   ip = 0;
@@ -64,14 +89,19 @@ exec(char *path, char **argv)
   p = myproc();
   uint64 oldsz = p->sz;
 
-  // Allocate two pages at the next page boundary.
-  // Use the second as the user stack.
+  // Reserve USTACKMAX pages at the next page boundary for
+  // the user stack, with a guard page below them. Only the
+  // top page, for the arguments, is allocated now; the rest
+  // is faulted in as the stack grows down into it, like
+  // heap. The guard is mapped but inaccessible, so that
+  // overflowing the limit traps.
   sz = PGROUNDUP(sz);
-  uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
+  if(uvmalloc(pagetable, sz, sz + PGSIZE) == 0)
+    goto bad;
+  uvmclear(pagetable, sz);
+  sz += PGSIZE + USTACKMAX*PGSIZE;
+  if(sz > UMAXVA || uvmalloc(pagetable, sz - PGSIZE, sz) == 0)
     goto bad;
-  sz = sz1;
-  uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
   stackbase = sp - PGSIZE;
 
@@ -108,10 +138,21 @@ exec(char *path, char **argv)
       last = s+1;
   safestrcpy(p->name, last, sizeof(p->name));
     
-  // Commit to the user image.
+  // Commit to the user image. The old image's pages go
+  // with its page table; its regions go here.
+  vmafree(p, p->pagetable);
+  for(i = 0; i < nseg; i++)
+    vmainsert(p, seg[i]);
+
+  acquire(&p->lock);
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
+  p->stacktop = sz;
+  kvmresync(p->kpagetable, pagetable);
+  p->tlbflush = 1;  // same ASID, new page table
+  w_satp(procsatp(p));
+  release(&p->lock);
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
@@ -121,37 +162,11 @@ exec(char *path, char **argv)
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
+  for(i = 0; i < nseg; i++)
+    vmaclose(seg[i]);
   if(ip){
     iunlockput(ip);
     end_op();
   }
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
-{
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
-}
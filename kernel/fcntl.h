@@ -13,4 +13,12 @@
 #define PROT_EXEC       0x4
 
 #define MAP_SHARED      0x01
-#define MAP_PRIVATE     0x02
\ No newline at end of file
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
\ No newline at end of file
@@ -12,17 +12,19 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "memstat.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;   // protects ref of every file
+  struct kcache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kcache_create("file", sizeof(struct file), PG_KERNEL);
 }
 
 // Allocate a file structure.
@@ -31,16 +33,10 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kcache_alloc(ftable.cache)) == 0)
+    return 0;
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -72,6 +68,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kcache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -106,7 +103,8 @@ filestat(struct file *f, uint64 addr)
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  struct proc *p = myproc();
+  int r = 0, m;
 
   if(f->readable == 0)
     return -1;
@@ -118,10 +116,23 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    vmaprefault(p, addr, n, PTE_W);
+    for(;;){
+      p->faultva = 0;
+      ilock(f->ip);
+      if((m = readi(f->ip, 1, addr + r, f->off, n - r)) > 0){
+        f->off += m;
+        r += m;
+      }
+      iunlock(f->ip);
+      // the copy stopped at a page of the buffer that
+      // vmafault() couldn't read in with f->ip locked (see
+      // vmafault()): fault it in now, and go on from there.
+      if(p->faultva == 0 || r == n || pagefault(p->pagetable, p->faultva, PTE_W) < 0)
+        break;
+    }
+    if(r == 0 && m < 0)
+      r = -1;
   } else {
     panic("fileread");
   }
@@ -134,6 +145,7 @@ fileread(struct file *f, uint64 addr, int n)
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
+  struct proc *p = myproc();
   int r, ret = 0;
 
   if(f->writable == 0)
@@ -159,6 +171,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      vmaprefault(p, addr + i, n1, PTE_R);
+      p->faultva = 0;
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -167,8 +181,11 @@ filewrite(struct file *f, uint64 addr, int n)
       end_op();
 
       if(r != n1){
-        // error from writei
-        break;
+        // error from writei, unless the copy stopped at a
+        // page that vmafault() left to fault in unlocked,
+        // as in fileread().
+        if(r < 0 || p->faultva == 0 || pagefault(p->pagetable, p->faultva, PTE_R) < 0)
+          break;
       }
       i += r;
     }
@@ -18,6 +18,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int ntext;          // Program segments mapping it (see itextdup())
+  int nwmap;          // Writable MAP_SHARED mappings of it (see iwmapdup())
+  struct inode *next; // icache hash chain
+  struct inode *prev, *lnext; // icache LRU list, while ref == 0
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -27,8 +31,15 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+
+  struct cpage *pages; // cached pages, guarded by pcache.lock
 };
 
+// how pcacheget() gets a page that isn't cached.
+#define PC_CACHED 0  // it doesn't: only cached pages
+#define PC_READ   1  // read it in
+#define PC_AHEAD  2  // read it in to read ahead: not if memory is short
+
 // map major device number to device functions.
 struct devsw {
   int (*read)(int, uint64, int);
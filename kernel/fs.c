@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "memstat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -138,7 +139,7 @@ bfree(int dev, uint b)
 //   cache entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid if it frees the inode on disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -166,25 +167,59 @@ bfree(int dev, uint b)
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
+// In-memory inodes come from an object cache and are
+// kept on hash chains by inode number. When the last iput()
+// drops a valid inode, it stays on its chain, and on an LRU
+// list, so that the next iget() of it needn't read it from
+// disk again. Once NICACHE are kept, the least recently used
+// that has no cached pages goes back to the object cache; an
+// inode's cached pages keep it until the page cache's own LRU
+// reclaims them, however long after the last close.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kcache *cache;
+  struct inode *hash[NIHASH];
+  struct inode lru;      // head of the LRU list, most recent last
+  int nlru;              // inodes on it
 } icache;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.cache = kcache_create("inode", sizeof(struct inode), PG_KERNEL);
+  icache.lru.prev = &icache.lru;
+  icache.lru.lnext = &icache.lru;
+}
+
+// Take ip off the LRU list. Caller holds icache.lock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->prev->lnext = ip->lnext;
+  ip->lnext->prev = ip->prev;
+  icache.nlru--;
+}
+
+// Take ip off its hash chain and free it, with its cached
+// pages. Caller holds icache.lock, and ip->ref is 0.
+static void
+ifree(struct inode *ip)
+{
+  struct inode **pp;
+
+  for(pp = &icache.hash[ip->inum % NIHASH]; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  pcachedrop(ip);
+  kcache_free(icache.cache, ip);
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -242,31 +277,39 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = icache.hash[inum % NIHASH]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruremove(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Allocate an inode cache entry. If memory is short,
+  // give back the least recently used unreferenced ones;
+  // kcache_alloc() gets their memory at once.
+  while((ip = kcache_alloc(icache.cache)) == 0){
+    if(icache.lru.lnext == &icache.lru)
+      panic("iget: no inodes");
+    ip = icache.lru.lnext;
+    lruremove(ip);
+    ifree(ip);
+  }
 
-  ip = empty;
+  initsleeplock(&ip->lock, "inode");
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->pages = 0;
+  ip->next = icache.hash[inum % NIHASH];
+  icache.hash[inum % NIHASH] = ip;
   release(&icache.lock);
 
   return ip;
@@ -283,6 +326,63 @@ idup(struct inode *ip)
   return ip;
 }
 
+// Take a reference to ip for a segment of a running program,
+// which maps the file's cached pages as they are; while there
+// are any, ip can't be written or truncated, the way other
+// systems return ETXTBSY. exec() takes the first with ip
+// locked, so that no write is half done when it does.
+// Returns 0 if a writable MAP_SHARED mapping of ip could
+// still change the program's pages.
+struct inode*
+itextdup(struct inode *ip)
+{
+  acquire(&icache.lock);
+  if(ip->nwmap > 0){
+    release(&icache.lock);
+    return 0;
+  }
+  ip->ref++;
+  ip->ntext++;
+  release(&icache.lock);
+  return ip;
+}
+
+// Drop a reference taken by itextdup().
+// Must be inside a transaction, like iput().
+void
+itextput(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->ntext--;
+  release(&icache.lock);
+  iput(ip);
+}
+
+// Count a writable MAP_SHARED mapping of ip, whose stores
+// go straight to the file's cached pages. Returns -1 if a
+// running program maps ip, since they would change its text.
+int
+iwmapdup(struct inode *ip)
+{
+  acquire(&icache.lock);
+  if(ip->ntext > 0){
+    release(&icache.lock);
+    return -1;
+  }
+  ip->nwmap++;
+  release(&icache.lock);
+  return 0;
+}
+
+// Drop a count taken by iwmapdup().
+void
+iwmapput(struct inode *ip)
+{
+  acquire(&icache.lock);
+  ip->nwmap--;
+  release(&icache.lock);
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -295,6 +395,8 @@ ilock(struct inode *ip)
     panic("ilock");
 
   acquiresleep(&ip->lock);
+  if(myproc())
+    myproc()->nilock++;
 
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
@@ -319,12 +421,14 @@ iunlock(struct inode *ip)
   if(ip == 0 || !holdingsleep(&ip->lock) || ip->ref < 1)
     panic("iunlock");
 
+  if(myproc())
+    myproc()->nilock--;
   releasesleep(&ip->lock);
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry is
+// kept for a while if valid (see above), and freed if not.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -353,7 +457,29 @@ iput(struct inode *ip)
     acquire(&icache.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    if(ip->valid){
+      // keep it, in case it's wanted again soon.
+      ip->prev = icache.lru.prev;
+      ip->lnext = &icache.lru;
+      ip->prev->lnext = ip;
+      icache.lru.prev = ip;
+      icache.nlru++;
+      // free the least recently used without cached pages;
+      // the others wait for pcachereclaim() to take those.
+      ip = icache.lru.lnext;
+      while(icache.nlru > NICACHE && ip != &icache.lru){
+        struct inode *next = ip->lnext;
+        if(ip->pages == 0){
+          lruremove(ip);
+          ifree(ip);
+        }
+        ip = next;
+      }
+    } else {
+      ifree(ip);
+    }
+  }
   release(&icache.lock);
 }
 
@@ -404,6 +530,38 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Are the blocks holding bytes [off, off+n) of ip all in the
+// buffer cache, so that reading them needs no disk I/O?
+// Bytes past the end of the file, or in holes, need none.
+// Caller must hold ip->lock.
+int
+icached(struct inode *ip, uint off, uint n)
+{
+  uint bn, addr;
+  struct buf *bp;
+
+  if(off >= ip->size || n == 0)
+    return 1;
+  if(n > ip->size - off)
+    n = ip->size - off;
+  for(bn = off/BSIZE; bn <= (off + n - 1)/BSIZE; bn++){
+    if(bn < NDIRECT){
+      addr = ip->addrs[bn];
+    } else {
+      if((addr = ip->addrs[NDIRECT]) == 0)
+        continue;
+      if(!bcached(ip->dev, addr))
+        return 0;
+      bp = bread(ip->dev, addr);
+      addr = ((uint*)bp->data)[bn - NDIRECT];
+      brelse(bp);
+    }
+    if(addr && !bcached(ip->dev, addr))
+      return 0;
+  }
+  return 1;
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -413,6 +571,7 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcachedrop(ip);
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -448,12 +607,12 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
-// Read data from inode.
+// Read data from inode's blocks, through the buffer cache.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
-readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+readblocks(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
   struct buf *bp;
@@ -476,6 +635,42 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Read data from inode.
+// Caller must hold ip->lock.
+// If user_dst==1, then dst is a user virtual address;
+// otherwise, dst is a kernel address.
+// Regular files are read through the page cache, so that
+// read() sees the same pages as mmap(MAP_SHARED).
+int
+readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  char *pa;
+  int r;
+
+  if(ip->type != T_FILE)
+    return readblocks(ip, user_dst, dst, off, n);
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((pa = pcacheget(ip, PGROUNDDOWN(off), PC_READ)) == 0)
+      return -1;
+    r = either_copyout(user_dst, dst, pa + (off % PGSIZE), m);
+    kfree(pa);
+    if(r == -1){
+      // what was copied before the bad address counts.
+      if(tot == 0)
+        tot = -1;
+      break;
+    }
+  }
+  return tot;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -493,6 +688,8 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(user_src && ip->ntext > 0)
+    return -1;   // a running program maps it
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
@@ -501,6 +698,9 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    // the page cache is written through, so that
+    // mappings of the page see the write at once.
+    pcachewrite(ip, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
   }
@@ -1,6 +1,11 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or physically contiguous runs of 2^order pages.
+//
+// Free memory is kept by a buddy allocator. Single pages
+// are usually served from small per-CPU free lists that
+// are refilled from, and drained back to, the buddy lists.
 
 #include "types.h"
 #include "param.h"
@@ -8,25 +13,186 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define NSTEAL   32   // max pages moved by one steal
+#define NREFILL  32   // pages moved from buddy lists to a CPU list
+#define NCPUHIGH 128  // CPU list length at which pages go back to buddy
+#define NZERO    256  // pre-zeroed pages kept by idle CPUs
+#define NZEROFILL 16  // pages zeroed per kzerofill() call
+
+#define NPAGE   ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PG(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define PG2PA(i)  ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
+
 struct run {
   struct run *next;
+  struct run *prev;  // buddy lists only
 };
 
-struct {
+// Each CPU has its own free list, so that kalloc() and kfree()
+// normally take a lock no other CPU is using. A CPU whose list
+// is empty refills it from the buddy lists, and if those are
+// empty too, steals a batch of pages from another CPU's list.
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;        // pages on freelist
+  uint64 hits;      // kalloc()s satisfied by this CPU's list
+  uint64 steals;    // times this CPU had to steal
+} kmem[NCPU];
+
+// Buddy allocator. A free block of 2^k pages starts at
+// a page index that is a multiple of 2^k (counting from
+// KERNBASE, so that large blocks are also physically
+// aligned), and is on free[k]. Freeing a block merges
+// it with its buddy for as long as the buddy is free.
+struct {
+  struct spinlock lock;
+  struct run *free[MAXORDER];  // circular, doubly linked
+  int nfree[MAXORDER];         // blocks on free[k]
+  uchar order[NPAGE];          // order of block starting at page
+  uchar isfree[NPAGE];         // page starts a free block
+} buddy;
+
+// Reference counts of allocated pages, so that copy-on-write
+// fork can share a physical page between page tables.
+// Allocation sets a page's count to 1; kfree() only gives the
+// page back when the count drops to 0. For a block from
+// kalloc_pages(), the count is kept in its first page.
+int pgref[NPAGE];
+
+// Accounting: the class of each page (see memstat.h), and
+// how many pages each class holds. Allocation puts a page
+// in PG_KERNEL; callers move it with ksetclass().
+uchar pgclass[NPAGE];
+int pgcount[NPGCLASS];
+int npages;  // pages given to the allocator
+
+// Pages zeroed ahead of time by idle CPUs, for kalloc_zeroed().
+struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+} kzero;
+
+// Fill pa with junk to catch dangling refs,
+// only in kernels built with KDEBUG=1.
+static inline void
+junk(void *pa, int c, uint n)
+{
+#ifdef KDEBUG
+  memset(pa, c, n);
+#endif
+}
+
+// Move n pages starting at pa into class c.
+static void
+kaccount(void *pa, int n, int c)
+{
+  uint64 i = PA2PG(pa);
+
+  for(; n > 0; n--, i++){
+    __sync_fetch_and_sub(&pgcount[pgclass[i]], 1);
+    pgclass[i] = c;
+    __sync_fetch_and_add(&pgcount[c], 1);
+  }
+}
+
+static void
+blist_add(int k, struct run *r)
+{
+  struct run *h = buddy.free[k];
+
+  if(h == 0){
+    r->next = r->prev = r;
+    buddy.free[k] = r;
+  } else {
+    r->next = h;
+    r->prev = h->prev;
+    h->prev->next = r;
+    h->prev = r;
+  }
+  buddy.nfree[k]++;
+}
+
+static void
+blist_remove(int k, struct run *r)
+{
+  if(r->next == r){
+    buddy.free[k] = 0;
+  } else {
+    r->prev->next = r->next;
+    r->next->prev = r->prev;
+    if(buddy.free[k] == r)
+      buddy.free[k] = r->next;
+  }
+  buddy.nfree[k]--;
+}
+
+// Put the block of 2^k pages at pa on the free lists,
+// coalescing with free buddies. Caller holds buddy.lock.
+static void
+bfree(void *pa, int k)
+{
+  uint64 i, b;
+
+  i = PA2PG(pa);
+  while(k < MAXORDER-1){
+    b = i ^ (1L << k);
+    if(!buddy.isfree[b] || buddy.order[b] != k)
+      break;
+    blist_remove(k, (struct run*)PG2PA(b));
+    buddy.isfree[b] = 0;
+    i &= ~(1L << k);
+    k++;
+  }
+  buddy.order[i] = k;
+  buddy.isfree[i] = 1;
+  blist_add(k, (struct run*)PG2PA(i));
+}
+
+// Take a block of 2^k pages off the free lists, splitting
+// a larger block if necessary. Caller holds buddy.lock.
+static void*
+balloc(int k)
+{
+  struct run *r;
+  uint64 i;
+  int j;
+
+  for(j = k; j < MAXORDER; j++)
+    if(buddy.free[j])
+      break;
+  if(j == MAXORDER)
+    return 0;
+
+  r = buddy.free[j];
+  blist_remove(j, r);
+  i = PA2PG(r);
+  buddy.isfree[i] = 0;
+  while(j > k){
+    j--;
+    buddy.order[i + (1L << j)] = j;
+    buddy.isfree[i + (1L << j)] = 1;
+    blist_add(j, (struct run*)PG2PA(i + (1L << j)));
+  }
+  buddy.order[i] = k;
+  return (void*)r;
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  initlock(&kzero.lock, "kzero");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +201,228 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  acquire(&buddy.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    bfree(p, 0);
+    npages++;
+    pgcount[PG_FREE]++;
+  }
+  release(&buddy.lock);
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+static void
+kcheck(void *pa, char *who)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic(who);
+}
+
+// Add a reference to the allocated page pa.
+void
+kref(void *pa)
+{
+  kcheck(pa, "kref");
+  __sync_fetch_and_add(&pgref[PA2PG(pa)], 1);
+}
+
+// Number of references to the allocated page pa.
+int
+krefcnt(void *pa)
+{
+  return pgref[PA2PG(pa)];
+}
+
+// Drop a reference to pa, and return how many remain.
+static int
+kunref(void *pa, char *who)
+{
+  int n;
+
+  if((n = __sync_sub_and_fetch(&pgref[PA2PG(pa)], 1)) < 0)
+    panic(who);
+  return n;
+}
+
+// Return up to n pages from CPU id's list to the buddy
+// lists. Interrupts must be disabled.
+static void
+kdrain(int id, int n)
+{
+  struct run *r, *next;
+  int i;
+
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  for(i = 0; i < n && kmem[id].freelist; i++)
+    kmem[id].freelist = kmem[id].freelist->next;
+  kmem[id].nfree -= i;
+  release(&kmem[id].lock);
+
+  acquire(&buddy.lock);
+  for(; i > 0; i--){
+    next = r->next;
+    bfree(r, 0);
+    r = next;
+  }
+  release(&buddy.lock);
+}
+
+// Push the chain head..tail of n pages onto this
+// CPU's list, and give pages back to the buddy lists
+// if the list has grown long.
+static void
+kpush(struct run *head, struct run *tail, int n)
+{
+  int id, over;
+
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  tail->next = kmem[id].freelist;
+  kmem[id].freelist = head;
+  kmem[id].nfree += n;
+  over = kmem[id].nfree > NCPUHIGH;
+  release(&kmem[id].lock);
+  if(over)
+    kdrain(id, NCPUHIGH/2);
+  pop_off();
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc() or kalloc_zeroed(), and free the page
+// if that was the last reference.
 void
 kfree(void *pa)
 {
   struct run *r;
 
-  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
-    panic("kfree");
-
-  // Fill with junk to catch dangling refs.
-  memset(pa, 1, PGSIZE);
+  kcheck(pa, "kfree");
+  if(kunref(pa, "kfree: refcount") > 0)
+    return;
+  kaccount(pa, 1, PG_FREE);
+  junk(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
+  kpush(r, r, 1);
+}
+
+// kfree() n pages at once, taking this CPU's
+// free-list lock only once. Used when tearing
+// down address spaces.
+void
+kfreebatch(void **pa, int n)
+{
+  struct run *head, *tail, *r;
+  int i, nfree;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  head = tail = 0;
+  nfree = 0;
+  for(i = 0; i < n; i++){
+    kcheck(pa[i], "kfreebatch");
+    if(kunref(pa[i], "kfreebatch: refcount") > 0)
+      continue;
+    nfree++;
+    kaccount(pa[i], 1, PG_FREE);
+    junk(pa[i], 1, PGSIZE);
+    r = (struct run*)pa[i];
+    r->next = head;
+    head = r;
+    if(tail == 0)
+      tail = r;
+  }
+  if(nfree > 0)
+    kpush(head, tail, nfree);
+}
+
+// Move NREFILL pages from the buddy lists onto CPU id's
+// list, keeping one for the caller.
+// Interrupts must be disabled.
+static struct run*
+krefill(int id)
+{
+  struct run *r, *head, *tail;
+  int n;
+
+  head = tail = 0;
+  acquire(&buddy.lock);
+  for(n = 0; n < NREFILL; n++){
+    if((r = balloc(0)) == 0)
+      break;
+    r->next = head;
+    head = r;
+    if(tail == 0)
+      tail = r;
+  }
+  release(&buddy.lock);
+
+  if(n > 1){
+    acquire(&kmem[id].lock);
+    tail->next = kmem[id].freelist;
+    kmem[id].freelist = head->next;
+    kmem[id].nfree += n - 1;
+    release(&kmem[id].lock);
+  }
+  return head;
+}
+
+// This CPU's list and the buddy lists are empty:
+// take up to half of the first non-empty neighbour
+// list, keep one page for the caller and put the
+// rest on our own list. Only one free-list lock is
+// held at a time. Interrupts must be disabled.
+static struct run*
+ksteal(int id)
+{
+  struct run *r, *last;
+  int i, j, n;
+
+  for(i = 1; i < NCPU; i++){
+    j = (id + i) % NCPU;
+    acquire(&kmem[j].lock);
+    if(kmem[j].freelist == 0){
+      release(&kmem[j].lock);
+      continue;
+    }
+    n = (kmem[j].nfree + 1) / 2;
+    if(n > NSTEAL)
+      n = NSTEAL;
+    r = last = kmem[j].freelist;
+    for(int k = 1; k < n; k++)
+      last = last->next;
+    kmem[j].freelist = last->next;
+    kmem[j].nfree -= n;
+    release(&kmem[j].lock);
+
+    acquire(&kmem[id].lock);
+    kmem[id].steals++;
+    if(n > 1){
+      last->next = kmem[id].freelist;
+      kmem[id].freelist = r->next;
+      kmem[id].nfree += n - 1;
+    }
+    release(&kmem[id].lock);
+    return r;
+  }
+  return 0;
+}
+
+// Take a page from the zeroed pool, or 0 if it is empty.
+static struct run*
+kzeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  r = kzero.list;
+  if(r){
+    kzero.list = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  if(r)
+    r->next = 0;
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +432,256 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+    kmem[id].hits++;
+  }
+  release(&kmem[id].lock);
+  if(r == 0)
+    r = krefill(id);
+  if(r == 0)
+    r = ksteal(id);
+  pop_off();
+  if(r == 0)
+    r = kzeropop();
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+  if(r){
+    junk(r, 5, PGSIZE);
+    pgref[PA2PG(r)] = 1;
+    kaccount(r, 1, PG_KERNEL);
+  }
   return (void*)r;
 }
+
+// Allocate one page of physical memory filled with zeros,
+// preferably one that an idle CPU has already cleared.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  void *pa;
+
+  if((pa = kzeropop()) != 0){
+    pgref[PA2PG(pa)] = 1;
+    kaccount(pa, 1, PG_KERNEL);
+    return pa;
+  }
+  if((pa = kalloc()) != 0)
+    memset(pa, 0, PGSIZE);
+  return pa;
+}
+
+// Called by an idle CPU in scheduler() before it waits
+// for an interrupt: top up the pool of zeroed pages a
+// few pages at a time.
+void
+kzerofill(void)
+{
+  struct run *r;
+
+  for(int i = 0; i < NZEROFILL && kzero.n < NZERO; i++){
+    if((r = kalloc()) == 0)
+      break;
+    memset(r, 0, PGSIZE);
+    pgref[PA2PG(r)] = 0;
+    kaccount(r, 1, PG_FREE);
+    acquire(&kzero.lock);
+    r->next = kzero.list;
+    kzero.list = r;
+    kzero.n++;
+    release(&kzero.lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. If no such run is free and drain is set,
+// empty the per-CPU lists and the zero pool back into the
+// buddy lists, which may coalesce, and try again.
+// Returns 0 on failure.
+static void *
+kpages(int order, int drain)
+{
+  struct run *r;
+  void *pa;
+
+  if(order < 0 || order >= MAXORDER)
+    return 0;
+
+  acquire(&buddy.lock);
+  pa = balloc(order);
+  release(&buddy.lock);
+
+  if(pa == 0 && drain){
+    push_off();
+    for(int i = 0; i < NCPU; i++)
+      kdrain(i, NPAGE);
+    pop_off();
+    acquire(&buddy.lock);
+    while((r = kzeropop()) != 0)
+      bfree(r, 0);
+    pa = balloc(order);
+    release(&buddy.lock);
+  }
+
+  if(pa){
+    junk(pa, 5, PGSIZE << order);
+    pgref[PA2PG(pa)] = 1;
+    kaccount(pa, 1 << order, PG_KERNEL);
+  }
+  return pa;
+}
+
+// Allocate 2^order physically contiguous pages,
+// aligned to their size. Returns 0 if no such run
+// of pages is free, even after emptying the
+// per-CPU lists back into the buddy lists.
+void *
+kalloc_pages(int order)
+{
+  return kpages(order, 1);
+}
+
+// The order of the block at pa from kalloc_pages().
+int
+korder(void *pa)
+{
+  kcheck(pa, "korder");
+  return buddy.order[PA2PG(pa)];
+}
+
+// Drop a reference to 2^order pages allocated by
+// kalloc_pages(order), and free them if it was the last.
+void
+kfree_pages(void *pa, int order)
+{
+  kcheck(pa, "kfree_pages");
+  if(order < 0 || order >= MAXORDER || PA2PG(pa) % (1L << order) != 0)
+    panic("kfree_pages");
+  if(kunref(pa, "kfree_pages: refcount") > 0)
+    return;
+  kaccount(pa, 1 << order, PG_FREE);
+  junk(pa, 1, PGSIZE << order);
+
+  acquire(&buddy.lock);
+  bfree(pa, order);
+  release(&buddy.lock);
+}
+
+// Allocate 2^order physically contiguous pages, like
+// kalloc_pages(), but give each page its own reference
+// count of 1, so that the pages can later be shared and
+// freed one at a time with kref() and kfree(). Used for
+// megapages, which may be split into single pages.
+// A megapage is only worth having if one is free: the
+// caller falls back to single pages, so this doesn't
+// empty the per-CPU lists and the zero pool to find one.
+void *
+kalloc_split(int order)
+{
+  char *pa;
+
+  if((pa = kpages(order, 0)) == 0)
+    return 0;
+  for(int i = 0; i < (1 << order); i++)
+    pgref[PA2PG(pa) + i] = 1;
+  return pa;
+}
+
+// Drop a reference to each of the 2^order pages at pa,
+// which came from kalloc_split(order). If all of them are
+// then free, give the block straight back to the buddy
+// lists instead of scattering it over the CPU lists.
+void
+kfree_split(void *pa, int order)
+{
+  struct run *head, *tail, *r;
+  int i, nfree;
+
+  kcheck(pa, "kfree_split");
+  if(order < 0 || order >= MAXORDER || PA2PG(pa) % (1L << order) != 0)
+    panic("kfree_split");
+
+  head = tail = 0;
+  nfree = 0;
+  for(i = 0; i < (1 << order); i++){
+    r = (struct run*)((char*)pa + i*PGSIZE);
+    if(kunref(r, "kfree_split: refcount") > 0)
+      continue;
+    nfree++;
+    kaccount(r, 1, PG_FREE);
+    junk(r, 1, PGSIZE);
+    r->next = head;
+    head = r;
+    if(tail == 0)
+      tail = r;
+  }
+
+  if(nfree == (1 << order)){
+    acquire(&buddy.lock);
+    bfree(pa, order);
+    release(&buddy.lock);
+  } else if(nfree > 0){
+    kpush(head, tail, nfree);
+  }
+}
+
+// Put the allocated page pa in accounting class c.
+void
+ksetclass(void *pa, int c)
+{
+  kcheck(pa, "ksetclass");
+  if(c <= PG_FREE || c >= NPGCLASS)
+    panic("ksetclass");
+  kaccount(pa, 1, c);
+}
+
+// Accounting class of the page pa.
+int
+kgetclass(void *pa)
+{
+  return pgclass[PA2PG(pa)];
+}
+
+// Fill in the system-wide page counts.
+void
+kmemstat(struct memstat *ms)
+{
+  ms->total = npages;
+  for(int c = 0; c < NPGCLASS; c++)
+    ms->pages[c] = pgcount[c];
+}
+
+// Print per-CPU allocator statistics, and how
+// fragmented free memory is. For debugging.
+// Runs when user types ^P on console.
+void
+kallocdump(void)
+{
+  int cached = 0, total = 0, largest = -1;
+
+  for(int i = 0; i < NCPU; i++){
+    cached += kmem[i].nfree;
+    if(kmem[i].hits == 0 && kmem[i].steals == 0 && kmem[i].nfree == 0)
+      continue;
+    printf("kalloc: cpu %d free %d hits %d steals %d\n",
+           i, kmem[i].nfree, (int)kmem[i].hits, (int)kmem[i].steals);
+  }
+
+  printf("buddy:");
+  for(int k = 0; k < MAXORDER; k++){
+    printf(" %d", buddy.nfree[k]);
+    total += buddy.nfree[k] << k;
+    if(buddy.nfree[k])
+      largest = k;
+  }
+  printf(" (free blocks of order 0..%d)\n", MAXORDER-1);
+  printf("buddy: %d pages free, %d cached on cpus, %d zeroed, largest block %d pages\n",
+         total, cached, kzero.n, largest < 0 ? 0 : 1 << largest);
+}
@@ -11,23 +11,29 @@ void
 main()
 {
   if(cpuid() == 0){
+    // the devices are only mapped once paging is on.
+    kinit();         // physical page allocator
+    slabinit();      // kernel object caches
+    kvminit();       // create kernel page table
+    kvminithart();   // turn on paging
     consoleinit();
     printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
     printf("\n");
-    kinit();         // physical page allocator
-    kvminit();       // create kernel page table
-    kvminithart();   // turn on paging
     procinit();      // process table
+    vmainit();       // mapped-region cache
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode cache
+    pcacheinit();    // page cache
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(); // emulated hard disk
+    swapinit();      // swap space
     userinit();      // first user process
     __sync_synchronize();
     started = 1;
@@ -35,8 +41,8 @@ main()
     while(started == 0)
       ;
     __sync_synchronize();
-    printf("hart %d starting\n", cpuid());
     kvminithart();    // turn on paging
+    printf("hart %d starting\n", cpuid());
     trapinithart();   // install kernel trap vector
     plicinithart();   // ask PLIC for device interrupts
   }
@@ -17,12 +17,20 @@
 // end -- start of kernel page allocation area
 // PHYSTOP -- end RAM used by the kernel
 
-// qemu puts UART registers here in physical memory.
-#define UART0 0x10000000L
+// the kernel maps the devices it uses, UART0, VIRTIO0 and the
+// PLIC, at KDEV(pa) for physical address pa: above RAM, in the
+// same top-level page-table range, which leaves all of those
+// below KERNBASE to user memory. they can't be reached until
+// kvminithart() turns on paging.
+#define KDEVBASE 0xA0000000L
+#define KDEV(pa) (KDEVBASE + (pa))
+
+// qemu puts UART registers at 0x10000000 in physical memory.
+#define UART0 KDEV(0x10000000L)
 #define UART0_IRQ 10
 
 // virtio mmio interface
-#define VIRTIO0 0x10001000
+#define VIRTIO0 KDEV(0x10001000L)
 #define VIRTIO0_IRQ 1
 
 // core local interruptor (CLINT), which contains the timer.
@@ -30,8 +38,9 @@
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
-// qemu puts platform-level interrupt controller (PLIC) here.
-#define PLIC 0x0c000000L
+// qemu puts platform-level interrupt controller (PLIC)
+// at 0x0c000000.
+#define PLIC KDEV(0x0c000000L)
 #define PLIC_PRIORITY (PLIC + 0x0)
 #define PLIC_PENDING (PLIC + 0x1000)
 #define PLIC_MENABLE(hart) (PLIC + 0x2000 + (hart)*0x100)
@@ -51,9 +60,11 @@
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
-// each surrounded by invalid guard pages.
-#define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
+// map kernel stacks beneath the trampoline's megapage,
+// each surrounded by invalid guard pages, down to the
+// bottom of the last top-level range: NKSTACK of them.
+#define KSTACK(p) (MAXVA - MEGAPGSIZE - ((p)+1)* 2*PGSIZE)
+#define NKSTACK (((1L << 30) - MEGAPGSIZE) / (2*PGSIZE))
 
 // User memory layout.
 // Address zero first:
@@ -65,3 +76,14 @@
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// the kernel's mappings take two top-level page-table ranges,
+// the one from KERNBASE and the last. user memory other than
+// the trampoline and trapframe lies in the others: below
+// UMAXVA, or, for mmap() regions only, from UMMAPBASE to
+// UMMAPTOP. kernel mappings are global (PTE_G), so the TLB
+// may use them in a user address space too, where they would
+// hide user pages.
+#define UMAXVA KERNBASE
+#define UMMAPBASE (KERNBASE + (1L << 30))
+#define UMMAPTOP (MAXVA - (1L << 30))
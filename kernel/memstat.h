@@ -0,0 +1,25 @@
+// Page classes, for memory accounting. Every physical page
+// that kalloc.c manages is in exactly one class.
+#define PG_FREE    0  // on a free list
+#define PG_KERNEL  1  // other kernel memory
+#define PG_PGTBL   2  // page-table pages
+#define PG_USER    3  // process memory: text, data, heap, stack
+#define PG_KSTACK  4  // kernel stacks
+#define PG_PIPE    5  // pipes
+#define PG_MMAP    6  // mmap()ed file data
+#define PG_FILE    7  // page cache: file data processes share
+#define NPGCLASS   8
+
+struct memstat {
+  uint64 total;            // pages managed by the allocator
+  uint64 pages[NPGCLASS];  // pages in each class
+  uint64 swaptotal;        // pages of swap space
+  uint64 swapused;         // pages in swap
+};
+
+struct procmem {
+  int pid;
+  char name[16];
+  uint64 sz;               // size of address space (bytes)
+  uint64 rss;              // pages mapped (resident set size)
+};
@@ -1,8 +1,7 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC        64  // processes a memstat() caller makes room for
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // i-nodes usertests' iref cycles through
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -10,4 +9,12 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define NSWAP        8192  // pages of swap space
+#define SWAPSTART    FSSIZE  // first disk block of swap, after the file system
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     11    // kalloc_pages() serves 2^0 .. 2^(MAXORDER-1) pages
+#define FAULTAROUND  16    // pages an mmap fault maps, if their file blocks are cached
+#define READAHEAD    16    // pages a MADV_SEQUENTIAL fault reads ahead
+#define USTACKMAX    256   // pages a user stack may grow to
+#define NPCACHE      2048  // pages the page cache holds, at most
+#define NICACHE      64    // unused inodes kept in memory, at most
@@ -0,0 +1,202 @@
+// Page cache: page-sized copies of file data that processes
+// map directly, and that read() and write() go through, so
+// that processes running the same program, or mapping the
+// same file MAP_SHARED, share one copy of each page, and see
+// each other's changes at once.
+//
+// Each in-memory inode has a list of its cached pages, each
+// a whole page of the file, starting at a multiple of PGSIZE,
+// with zeros past the end of the file. The cache holds one
+// reference to every page, and each mapping of it another;
+// pcache.lock guards the lists. Pages are read in with the
+// inode locked, so no page is read in twice. A program
+// segment page that doesn't line up with a page of its file,
+// or that holds the end of the segment, isn't mapped from the
+// cache: vmafault() copies the segment's bytes out of it.
+//
+// Writes go through to the cached pages (see writei()). A
+// file that a running program maps can't be written at all
+// (see itextdup()), so its text never changes under it;
+// MAP_PRIVATE mappings see writes to pages they haven't
+// written themselves.
+//
+// Pages stay cached after the file is closed: the in-memory
+// inode is kept while it has any (see iput()). The pages of
+// an inode go when it is truncated or freed on disk, and
+// pages that nothing maps go when memory runs short, or the
+// cache holds NPCACHE pages, least recently used first.
+//
+// Reads fill pages from the buffer cache, so a block can be
+// in both; the buffer cache's NBUF buffers are recycled, so
+// that costs no more than NBUF blocks.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "memstat.h"
+
+struct cpage {
+  struct inode *ip;
+  uint off;              // file offset of the page, a multiple of PGSIZE
+  char *pa;
+  struct cpage *next;    // ip->pages
+  struct cpage *prev, *lnext;  // LRU list, most recent last
+};
+
+struct {
+  struct spinlock lock;
+  struct kcache *cache;
+  struct cpage lru;      // head of the LRU list
+  int n;                 // pages cached
+} pcache;
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.cache = kcache_create("cpage", sizeof(struct cpage), PG_KERNEL);
+  pcache.lru.prev = &pcache.lru;
+  pcache.lru.lnext = &pcache.lru;
+}
+
+// Take cp off the LRU list. Caller holds pcache.lock.
+static void
+lruremove(struct cpage *cp)
+{
+  cp->prev->lnext = cp->lnext;
+  cp->lnext->prev = cp->prev;
+}
+
+// Put cp at the recent end of the LRU list.
+// Caller holds pcache.lock.
+static void
+lruappend(struct cpage *cp)
+{
+  cp->prev = pcache.lru.prev;
+  cp->lnext = &pcache.lru;
+  pcache.lru.prev->lnext = cp;
+  pcache.lru.prev = cp;
+}
+
+// Remove cp from the cache and free it, dropping the
+// cache's reference to its page. Caller holds pcache.lock.
+static void
+cpfree(struct cpage *cp)
+{
+  struct cpage **pp;
+
+  for(pp = &cp->ip->pages; *pp != cp; pp = &(*pp)->next)
+    ;
+  *pp = cp->next;
+  lruremove(cp);
+  pcache.n--;
+  kfree(cp->pa);
+  kcache_free(pcache.cache, cp);
+}
+
+// Return the page of ip at file offset off, a multiple of
+// PGSIZE, with a reference for the caller. If it isn't cached, read it in
+// as fill says (see file.h), or else return 0. Returns 0 on
+// failure. Caller holds ip->lock unless fill is PC_CACHED.
+char*
+pcacheget(struct inode *ip, uint off, int fill)
+{
+  struct cpage *cp;
+  char *mem;
+
+  acquire(&pcache.lock);
+  for(cp = ip->pages; cp; cp = cp->next){
+    if(cp->off == off){
+      kref(cp->pa);
+      lruremove(cp);
+      lruappend(cp);
+      release(&pcache.lock);
+      return cp->pa;
+    }
+  }
+  release(&pcache.lock);
+  if(fill == PC_CACHED)
+    return 0;
+
+  if(pcache.n >= NPCACHE)
+    pcachereclaim(1);
+  if((cp = kcache_alloc(pcache.cache)) == 0)
+    return 0;
+  if((mem = kalloc_user(1, fill == PC_READ)) == 0){
+    kcache_free(pcache.cache, cp);
+    return 0;
+  }
+  ksetclass(mem, PG_FILE);
+  if(readblocks(ip, 0, (uint64)mem, off, PGSIZE) < 0){
+    kfree(mem);
+    kcache_free(pcache.cache, cp);
+    return 0;
+  }
+  cp->ip = ip;
+  cp->off = off;
+  cp->pa = mem;
+  kref(mem);
+
+  acquire(&pcache.lock);
+  cp->next = ip->pages;
+  ip->pages = cp;
+  lruappend(cp);
+  pcache.n++;
+  release(&pcache.lock);
+  return mem;
+}
+
+// Copy n bytes from src to the cached page of ip that holds
+// file offset off, if there is one, for a write to the file.
+// [off, off+n) lies within one page. Caller holds ip->lock.
+void
+pcachewrite(struct inode *ip, uint off, char *src, uint n)
+{
+  struct cpage *cp;
+
+  acquire(&pcache.lock);
+  for(cp = ip->pages; cp; cp = cp->next){
+    if(cp->off == PGROUNDDOWN(off)){
+      memmove(cp->pa + off % PGSIZE, src, n);
+      break;
+    }
+  }
+  release(&pcache.lock);
+}
+
+// Drop all of ip's cached pages.
+void
+pcachedrop(struct inode *ip)
+{
+  acquire(&pcache.lock);
+  while(ip->pages)
+    cpfree(ip->pages);
+  release(&pcache.lock);
+}
+
+// Free up to n cached pages that no process maps,
+// least recently used first. Returns how many were freed.
+int
+pcachereclaim(int n)
+{
+  struct cpage *cp, *next;
+  int freed = 0;
+
+  acquire(&pcache.lock);
+  for(cp = pcache.lru.lnext; cp != &pcache.lru && freed < n; cp = next){
+    next = cp->lnext;
+    if(krefcnt(cp->pa) == 1){
+      cpfree(cp);
+      freed++;
+    }
+  }
+  release(&pcache.lock);
+  return freed;
+}
@@ -7,6 +7,7 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "memstat.h"
 
 #define PIPESIZE 512
 
@@ -17,8 +18,17 @@ struct pipe {
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  int reading;    // a reader is copying bytes out
 };
 
+struct kcache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kcache_create("pipe", sizeof(struct pipe), PG_PIPE);
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,10 +38,11 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kcache_alloc(pipecache)) == 0)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
+  pi->reading = 0;
   pi->nwrite = 0;
   pi->nread = 0;
   initlock(&pi->lock, "pipe");
@@ -47,7 +58,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kcache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -68,7 +79,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kcache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
@@ -76,28 +87,33 @@ pipeclose(struct pipe *pi, int writable)
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
-  int i = 0;
+  int i = 0, j, m;
   struct proc *pr = myproc();
+  char buf[128];
 
-  acquire(&pi->lock);
   while(i < n){
-    if(pi->readopen == 0 || pr->killed){
-      release(&pi->lock);
-      return -1;
-    }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
-      wakeup(&pi->nread);
-      sleep(&pi->nwrite, &pi->lock);
-    } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
-        break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+    // copyin() may have to bring the page in from swap,
+    // which sleeps, so copy a chunk before taking pi->lock.
+    m = n - i < sizeof(buf) ? n - i : sizeof(buf);
+    if(copyin(pr->pagetable, buf, addr + i, m) == -1)
+      break;
+    acquire(&pi->lock);
+    for(j = 0; j < m; ){
+      if(pi->readopen == 0 || pr->killed){
+        release(&pi->lock);
+        return -1;
+      }
+      if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+        wakeup(&pi->nread);
+        sleep(&pi->nwrite, &pi->lock);
+      } else {
+        pi->data[pi->nwrite++ % PIPESIZE] = buf[j++];
+      }
     }
+    wakeup(&pi->nread);
+    release(&pi->lock);
+    i += m;
   }
-  wakeup(&pi->nread);
-  release(&pi->lock);
 
   return i;
 }
@@ -105,12 +121,12 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
 int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
-  int i;
+  int i, r;
   struct proc *pr = myproc();
-  char ch;
+  char buf[PIPESIZE];
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->reading){  //DOC: pipe-empty
     if(pr->killed){
       release(&pi->lock);
       return -1;
@@ -118,13 +134,25 @@ piperead(struct pipe *pi, uint64 addr, int n)
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
   for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    if(pi->nread + i == pi->nwrite)
       break;
+    buf[i] = pi->data[(pi->nread + i) % PIPESIZE];
   }
+  pi->reading = 1;
+  release(&pi->lock);
+
+  // copy out without pi->lock, since copyout() may sleep.
+  // the bytes stay in the pipe until they are copied, so a
+  // bad addr loses none of them; pi->reading keeps other
+  // readers from taking them meanwhile.
+  r = i > 0 ? copyout(pr->pagetable, addr, buf, i) : 0;
+
+  acquire(&pi->lock);
+  pi->reading = 0;
+  if(r == 0)
+    pi->nread += i;
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  wakeup(&pi->nread);
   release(&pi->lock);
-  return i;
+  return r == -1 ? -1 : i;
 }
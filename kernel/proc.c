@@ -6,50 +6,63 @@
 #include "proc.h"
 #include "defs.h"
 #include "fcntl.h"
+#include "memstat.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// The processes. A struct proc comes from an object cache,
+// with a kernel stack slot, the first time there is no UNUSED
+// one to reuse, and goes on the allproc list for good: it is
+// never freed, so pointers to procs stay valid, and loops
+// over the list need no lock. proclock keeps two allocproc()s
+// from adding one at once. The stack page itself comes and
+// goes with the process (see kstackalloc()).
+struct proc *allproc;
+int nprocs;
+struct spinlock proclock;
+struct kcache *proccache;
+uint64 kstackgen;   // bumped when a stack slot gets a new page
 
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Address-space identifiers. Each process runs in user space
+// with its own ASID in satp, so its TLB entries survive traps
+// into the kernel (ASID 0, all global mappings) and switches
+// to other processes. ASIDs are handed out in order and not
+// reused until they run out; then a new generation begins,
+// every process gets a new ASID when it next returns to user
+// space, and every CPU flushes its whole TLB before it uses
+// an ASID of the new generation.
+// p->asid holds the generation in the bits above the ASID.
+struct {
+  struct spinlock lock;
+  uint64 gen;     // current generation, a multiple of ASIDGEN
+  uint64 next;    // next ASID to hand out in this generation
+} asids;
+#define ASIDGEN (SATP_ASIDMASK + 1)
+
 extern void forkret(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
+extern int nasid;         // vm.c
+extern pagetable_t kernel_pagetable;  // vm.c
 
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-void
-proc_mapstacks(pagetable_t kpgtbl) {
-  struct proc *p;
-  
-  for(p = proc; p < &proc[NPROC]; p++) {
-    char *pa = kalloc();
-    if(pa == 0)
-      panic("kalloc");
-    uint64 va = KSTACK((int) (p - proc));
-    kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-  }
-}
-
 // initialize the proc table at boot time.
 void
 procinit(void)
 {
-  struct proc *p;
-  
   initlock(&pid_lock, "nextpid");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-      p->kstack = KSTACK((int) (p - proc));
-  }
+  initlock(&proclock, "proclist");
+  initlock(&asids.lock, "asid");
+  asids.gen = ASIDGEN;
+  asids.next = 1;
+  proccache = kcache_create("proc", sizeof(struct proc), PG_KERNEL);
 }
 
 // Must be called with interrupts disabled,
@@ -93,16 +106,156 @@ allocpid() {
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Return the satp for p's kernel page table on this CPU,
+// with the ASID under which p runs there in the kernel and in
+// user space (see usertrapret()), first flushing whatever TLB entries of p's may be stale:
+// those of a CPU that p has not just been running on, or
+// all of them if p's page table has changed in a way that
+// needs a flush (p->tlbflush). Interrupts must be off.
+uint64
+procsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  int flush = p->tlbflush || p->tlbcpu != cpuid();
+  uint64 gen;
+
+  p->tlbflush = 0;
+  p->tlbcpu = cpuid();
+  if(nasid <= 1){
+    // no ASIDs; every process uses ASID 0.
+    if(flush || c->uproc != p)
+      sfence_vma();
+    c->uproc = p;
+    return MAKE_SATP(p->kpagetable);
+  }
+
+  // a new generation may begin just after this check; p then
+  // keeps its old ASID until it next enters user space, which
+  // is safe since other CPUs flush before using the new one.
+  gen = __atomic_load_n(&asids.gen, __ATOMIC_ACQUIRE);
+  if((p->asid & ~SATP_ASIDMASK) != gen || c->asidgen != gen){
+    acquire(&asids.lock);
+    if((p->asid & ~SATP_ASIDMASK) != asids.gen){
+      if(asids.next == nasid){
+        __atomic_store_n(&asids.gen, asids.gen + ASIDGEN, __ATOMIC_RELEASE);
+        asids.next = 1;
+      }
+      p->asid = asids.gen | asids.next++;
+    }
+    if(c->asidgen != asids.gen){
+      sfence_vma();
+      c->asidgen = asids.gen;
+      flush = 0;
+    }
+    release(&asids.lock);
+  }
+  if(flush)
+    sfence_vma_asid(p->asid & SATP_ASIDMASK);
+  return MAKE_SATP_ASID(p->kpagetable, p->asid);
+}
+
+// Invalidate the TLB entries for the n addresses in va[], or
+// for the whole address space if n < 0, after mappings in
+// pagetable have changed. Only the current process's entries
+// can be in use: this CPU's are flushed here, and other CPUs'
+// when the process next runs there (see procsatp()).
+void
+proctlbflush(pagetable_t pagetable, uint64 *va, int n)
+{
+  struct proc *p = myproc();
+  uint64 asid;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  push_off();
+  if(p->tlbcpu == cpuid()){
+    asid = nasid > 1 ? p->asid & SATP_ASIDMASK : 0;
+    if(n < 0)
+      sfence_vma_asid(asid);
+    for(int i = 0; i < n; i++)
+      sfence_vma_va(va[i], asid);
+  }
+  pop_off();
+}
+
+// Map a new kernel stack page at p->kstack, whose slot
+// already has its page-table page. A CPU may still have the
+// slot's old page in its TLB, from an earlier process, so
+// kstackgen moves on, and scheduler() flushes a CPU's TLB
+// before it next runs a process. Returns -1 if out of memory.
+static int
+kstackalloc(struct proc *p)
+{
+  pte_t *pte;
+  char *stack;
+
+  if((stack = kalloc()) == 0)
+    return -1;
+  ksetclass(stack, PG_KSTACK);
+  pte = walk(kernel_pagetable, p->kstack, 0);
+  *pte = PA2PTE(stack) | PTE_R | PTE_W | PTE_G | PTE_V;
+  __sync_fetch_and_add(&kstackgen, 1);
+  return 0;
+}
+
+// Unmap and free p's kernel stack page, if it has one.
+// p is not running, and until kstackalloc() maps a new
+// page no CPU uses the slot.
+static void
+kstackfree(struct proc *p)
+{
+  pte_t *pte;
+
+  pte = walk(kernel_pagetable, p->kstack, 0);
+  if(*pte & PTE_V){
+    kfree((void*)PTE2PA(*pte));
+    *pte = 0;
+  }
+}
+
+// Make a new UNUSED proc, with the next KSTACK() slot for its
+// kernel stack, and add it to allproc. Every process's kernel
+// page table shares the kernel's page-table pages for the
+// stacks (see kvmcreate()), so the slot's page-table page is
+// made here, before any page table the process runs on.
+// Returns with p->lock held, or 0 if out of memory.
+static struct proc*
+newproc(void)
+{
+  struct proc *p;
+
+  acquire(&proclock);
+  if(nprocs == NKSTACK || (p = kcache_alloc(proccache)) == 0){
+    release(&proclock);
+    return 0;
+  }
+  p->kstack = KSTACK(nprocs);
+  if(walk(kernel_pagetable, p->kstack, 1) == 0){
+    kcache_free(proccache, p);
+    release(&proclock);
+    return 0;
+  }
+  initlock(&p->lock, "proc");
+  acquire(&p->lock);
+  p->next = allproc;
+  // the loops over allproc must see p's fields set.
+  __sync_synchronize();
+  allproc = p;
+  nprocs++;
+  release(&proclock);
+  return p;
+}
+
+// Look in the process table for an UNUSED proc, or make
+// a new one. Initialize state required to run in the
+// kernel, and return with p->lock held.
+// If a memory allocation fails, return 0.
 static struct proc*
 allocproc(void)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(p = allproc; p; p = p->next) {
     acquire(&p->lock);
     if(p->state == UNUSED) {
       goto found;
@@ -110,13 +263,24 @@ allocproc(void)
       release(&p->lock);
     }
   }
-  return 0;
+  if((p = newproc()) == 0)
+    return 0;
 
 found:
+  if(kstackalloc(p) < 0){
+    release(&p->lock);
+    return 0;
+  }
   p->pid = allocpid();
+  p->asid = 0;
+  p->tlbcpu = -1;
+  p->tlbflush = 0;
+  p->vmas = 0;
+  p->lastvma = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+    freeproc(p);
     release(&p->lock);
     return 0;
   }
@@ -129,6 +293,14 @@ found:
     return 0;
   }
 
+  // The page table the kernel runs on for it.
+  p->kpagetable = kvmcreate();
+  if(p->kpagetable == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
   // Set up new context to start executing at forkret,
   // which returns to user space.
   memset(&p->context, 0, sizeof(p->context));
@@ -147,6 +319,10 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
+  kstackfree(p);
+  if(p->kpagetable)
+    kvmfree(p->kpagetable);
+  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
@@ -177,7 +353,7 @@ proc_pagetable(struct proc *p)
   // only the supervisor uses it, on the way
   // to/from user space, so not PTE_U.
   if(mappages(pagetable, TRAMPOLINE, PGSIZE,
-              (uint64)trampoline, PTE_R | PTE_X) < 0){
+              (uint64)trampoline, PTE_R | PTE_X | PTE_G) < 0){
     uvmfree(pagetable, 0);
     return 0;
   }
@@ -246,16 +422,21 @@ userinit(void)
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    // just reserve the addresses; pagefault() allocates
+    // each page when it is first touched.
+    if(sz + n > UMAXVA || vmaoverlap(p, PGROUNDUP(sz), PGROUNDUP(sz + n)))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if(-(uint64)n > sz)
+      return -1;
+    if((sz = uvmdealloc(p->pagetable, sz, sz + n)) != p->sz + n)
+      return -1;
   }
   p->sz = sz;
   return 0;
@@ -275,13 +456,21 @@ fork(void)
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(mmapcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child. This write-protects
+  // the parent's pages, for copy-on-write.
+  p->tlbflush = 1;
+  if(mmapcopy(p->pagetable, np->pagetable, 0, p->sz, 1) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if(vmacopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->stacktop = p->stacktop;
 
 
   // copy saved user registers.
@@ -300,20 +489,10 @@ fork(void)
 
   pid = np->pid;
 
-
-   release(&np->lock);
-   np->parent = p;
-   acquire(&np->lock);
-   for(int i = 0; i < 16; i ++)
-   {
-     // 复制父进程的vmas的内容
-     memmove((void*)&np->vmas[i], (void*)&p->vmas[i], sizeof(p->vmas[i]));
-     // 增加引用计数
-     if(p->vmas[i].used == 1)
-       filedup(p->vmas[i].file);
-   }
-
-
+  // np->lock stays held from allocproc() until np is
+  // RUNNABLE: while np is UNUSED, another fork()'s
+  // allocproc() would take it if the lock were free.
+  np->parent = p;
   np->state = RUNNABLE;
 
   release(&np->lock);
@@ -328,7 +507,7 @@ reparent(struct proc *p)
 {
   struct proc *pp;
 
-  for(pp = proc; pp < &proc[NPROC]; pp++){
+  for(pp = allproc; pp; pp = pp->next){
     // this code uses pp->parent without holding pp->lock.
     // acquiring the lock first could cause a deadlock
     // if pp or a child of pp were also in exit()
@@ -369,19 +548,8 @@ exit(int status)
     }
   }
 
-for(int i = 0; i > 16; i ++)
-{
-  if(p->vmas[i].used == 1)
-  {
-    uint64 length = p->vmas[i].length;
-    // 减少文件引用计数
-    fileclose(p->vmas[i].file);
-    // 取消映射
-    mmapunmap(p->pagetable, p->vmas[i].st, PGROUNDUP(length) / PGSIZE, 1);
-    // 清空vma
-    memset((void*)&p->vmas[i], 0, sizeof(p->vmas[i]));
-  }
-}
+  // unmap mapped regions and drop their files.
+  vmafree(p, p->pagetable);
 
   begin_op();
   iput(p->cwd);
@@ -435,7 +603,7 @@ int
 wait(uint64 addr)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids, pid, xstate;
   struct proc *p = myproc();
 
   // hold p->lock for the whole time to avoid lost
@@ -445,7 +613,7 @@ wait(uint64 addr)
   for(;;){
     // Scan through table looking for exited children.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
+    for(np = allproc; np; np = np->next){
       // this code uses np->parent without holding np->lock.
       // acquiring the lock first would cause a deadlock,
       // since np might be an ancestor, and we already hold p->lock.
@@ -457,15 +625,14 @@ wait(uint64 addr)
         if(np->state == ZOMBIE){
           // Found one.
           pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
+          xstate = np->xstate;
           freeproc(np);
           release(&np->lock);
           release(&p->lock);
+          // copyout() may sleep, so it comes after the releases.
+          if(addr != 0 && copyout(p->pagetable, addr, (char *)&xstate,
+                                  sizeof(xstate)) < 0)
+            return -1;
           return pid;
         }
         release(&np->lock);
@@ -502,7 +669,7 @@ scheduler(void)
     intr_on();
     
     int nproc = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
+    for(p = allproc; p; p = p->next) {
       acquire(&p->lock);
       if(p->state != UNUSED) {
         nproc++;
@@ -511,17 +678,29 @@ scheduler(void)
         // Switch to chosen process.  It is the process's job
         // to release its lock and then reacquire it
         // before jumping back to us.
+        // The process's kernel code runs on its kernel page
+        // table, which maps its user memory as well.
         p->state = RUNNING;
         c->proc = p;
+        // p's kernel stack may be a new page in an old slot.
+        if(c->kstackgen != kstackgen){
+          c->kstackgen = kstackgen;
+          sfence_vma();
+        }
+        w_satp(procsatp(p));
         swtch(&c->context, &p->context);
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
+        // Leave its page table before its lock is released,
+        // since once it has exited the page table may be freed.
+        w_satp(MAKE_SATP(kernel_pagetable));
         c->proc = 0;
       }
       release(&p->lock);
     }
     if(nproc <= 2) {   // only init and sh exist
+      kzerofill();
       intr_on();
       asm volatile("wfi");
     }
@@ -628,7 +807,7 @@ wakeup(void *chan)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(p = allproc; p; p = p->next) {
     acquire(&p->lock);
     if(p->state == SLEEPING && p->chan == chan) {
       p->state = RUNNABLE;
@@ -657,7 +836,7 @@ kill(int pid)
 {
   struct proc *p;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->next){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
@@ -703,6 +882,46 @@ either_copyin(void *dst, int user_src, uint64 src, uint64 len)
   }
 }
 
+// Copy memory statistics to user space: the system-wide
+// page counts to ms, and the size and resident pages of
+// up to n processes to the array pm. Returns the number
+// of processes reported, or -1 if an address is bad.
+int
+memstat(uint64 ms, uint64 pm, int n)
+{
+  struct proc *p, *me = myproc();
+  struct memstat st;
+  struct procmem m;
+  int i = 0;
+
+  kmemstat(&st);
+  swapstat(&st);
+  if(copyout(me->pagetable, ms, (char*)&st, sizeof(st)) < 0)
+    return -1;
+
+  for(p = allproc; p && i < n; p = p->next){
+    // p->lock keeps exec() and wait() from freeing the
+    // page table, and the process itself from freeing its
+    // page-table pages (see unmaprange()), while it is
+    // being walked.
+    acquire(&p->lock);
+    if(p->state == UNUSED){
+      release(&p->lock);
+      continue;
+    }
+    m.pid = p->pid;
+    safestrcpy(m.name, p->name, sizeof(m.name));
+    m.sz = p->sz;
+    m.rss = p->pagetable ? uvmrss(p->pagetable) : 0;
+    release(&p->lock);
+
+    if(copyout(me->pagetable, pm + i*sizeof(m), (char*)&m, sizeof(m)) < 0)
+      return -1;
+    i++;
+  }
+  return i;
+}
+
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
 // No lock to avoid wedging a stuck machine further.
@@ -720,7 +939,7 @@ procdump(void)
   char *state;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(p = allproc; p; p = p->next){
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
@@ -730,4 +949,6 @@ procdump(void)
     printf("%d %s %s", p->pid, state, p->name);
     printf("\n");
   }
+  kallocdump();
+  kcachedump();
 }
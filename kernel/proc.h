@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation this CPU's TLB is flushed for.
+  struct proc *uproc;         // Process last run in user space, if no ASIDs.
+  uint64 kstackgen;           // kstackgen this CPU's TLB is flushed for.
 };
 
 extern struct cpu cpus[NCPU];
@@ -84,7 +87,6 @@ enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 //映射区域的结构体
 struct vma {
-  int used; //是否被使用
   uint64 st; //开始地址
   uint64 ed;  //结束地址 都是对齐的
   int length; //长度
@@ -92,6 +94,12 @@ struct vma {
   uint flags; //结束映射后是否要写入脏页
   int offset; //file的offset 但是默认都是0
   struct file* file;
+  struct inode *ip;  // program segment: the executable, or 0 for mmap
+  uint64 filesz;     // bytes from the file; the rest is zero-filled
+  int advice;        // MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL
+  struct shm *shm;   // shared anonymous memory's pages (vma.c)
+  struct vma *left, *right;  // p->vmas tree (vma.c)
+  int height;
 };
 
 
@@ -99,6 +107,7 @@ struct vma {
 // Per-process state
 struct proc {
   struct spinlock lock;
+  struct proc *next;           // allproc list; never changes once set
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
@@ -111,11 +120,19 @@ struct proc {
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
+  uint64 stacktop;             // Top of user stack; the heap lies above
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table (see kvmcreate())
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
-  struct vma vmas[16];
+  uint64 asid;                 // ASID generation and number, for satp
+  int tlbcpu;                  // CPU that last ran this process, or -1
+  int tlbflush;                // TLB may hold stale user mappings
+  struct vma *vmas;            // Mapped regions, a tree (vma.c)
+  struct vma *lastvma;         // Region vmafind() last found
+  int nilock;                  // Inode locks held (see vmafault())
+  uint64 faultva;              // Page vmafault() left to fault in unlocked
 };
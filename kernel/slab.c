@@ -0,0 +1,360 @@
+// Object caches for small, fixed-size kernel objects
+// (files, pipes, inodes), built on kalloc().
+//
+// Each cache carves whole pages ("slabs") into objects.
+// A slab starts with a struct slab header; the slab an
+// object belongs to is found by rounding its address
+// down to a page boundary.
+//
+// Each CPU keeps a small magazine of free objects per
+// cache, so most allocations and frees touch no shared
+// lock, only the magazine's own, which other CPUs take
+// only to drain it when memory is short. Magazines are
+// refilled from, and flushed back to, the cache's slabs
+// half a magazine at a time. A cache whose slabs hold
+// fewer objects than a magazine has none: its magazines
+// would keep whole slabs of free objects from the system.
+//
+// kmalloc() is a general-purpose allocator on top: small
+// sizes come from one of a set of power-of-two caches,
+// larger ones from whole blocks of pages.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "memstat.h"
+
+#define NKCACHE  16   // maximum number of caches
+#define MAGSIZE  16   // objects per per-CPU magazine
+#define KMMIN    16   // smallest kmalloc() size class
+#define NKMCLASS 7    // kmalloc() classes: 16, 32, ... 1024 bytes
+
+struct kcache;
+
+struct slab {
+  struct slab *next;     // cache's list of slabs with free objects
+  struct slab *prev;
+  struct kcache *cache;
+  void *free;            // free objects, linked through first word
+  int inuse;             // allocated objects, including magazines
+};
+
+// A magazine is used by its own CPU, with interrupts
+// disabled, and drained by kcachereclaim().
+struct magazine {
+  struct spinlock lock;
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kcache {
+  char *name;
+  uint size;                 // object size, rounded up
+  int perslab;               // objects per slab
+  int pgclass;               // accounting class of slab pages
+  struct spinlock lock;      // protects partial and counts below
+  struct slab *partial;      // slabs with free objects, circular
+  int nslab;                 // slabs allocated
+  int ninuse;                // objects handed out, including magazines
+  struct magazine mag[NCPU];
+};
+
+struct {
+  struct spinlock lock;
+  struct kcache cache[NKCACHE];
+  int n;
+} kcaches;
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+struct kcache *kmcache[NKMCLASS];
+char *kmnames[NKMCLASS] = {
+  "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+  "kmalloc-256", "kmalloc-512", "kmalloc-1024",
+};
+
+void
+slabinit(void)
+{
+  initlock(&kcaches.lock, "kcaches");
+  for(int i = 0; i < NKMCLASS; i++)
+    kmcache[i] = kcache_create(kmnames[i], KMMIN << i, PG_KERNEL);
+}
+
+// Create a cache of objects of the given size, whose
+// slab pages are accounted to pgclass (see memstat.h).
+// Caches are never destroyed.
+struct kcache*
+kcache_create(char *name, uint size, int pgclass)
+{
+  struct kcache *c;
+
+  size = (size + 15) & ~15;
+  if(size > PGSIZE - SLABHDR)
+    panic("kcache_create: too big");
+
+  acquire(&kcaches.lock);
+  if(kcaches.n == NKCACHE)
+    panic("kcache_create: too many caches");
+  c = &kcaches.cache[kcaches.n++];
+  release(&kcaches.lock);
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+  c->pgclass = pgclass;
+  initlock(&c->lock, name);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&c->mag[i].lock, "magazine");
+  return c;
+}
+
+static void
+partial_add(struct kcache *c, struct slab *s)
+{
+  if(c->partial == 0){
+    s->next = s->prev = s;
+    c->partial = s;
+  } else {
+    s->next = c->partial;
+    s->prev = c->partial->prev;
+    c->partial->prev->next = s;
+    c->partial->prev = s;
+  }
+}
+
+static void
+partial_remove(struct kcache *c, struct slab *s)
+{
+  if(s->next == s){
+    c->partial = 0;
+  } else {
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+    if(c->partial == s)
+      c->partial = s->next;
+  }
+}
+
+// Allocate a fresh slab and put it on the partial list.
+// Caller holds c->lock.
+static int
+slabgrow(struct kcache *c)
+{
+  struct slab *s;
+  char *o;
+
+  if((s = kalloc()) == 0)
+    return -1;
+  ksetclass(s, c->pgclass);
+  s->cache = c;
+  s->inuse = 0;
+  s->free = 0;
+  for(int i = c->perslab - 1; i >= 0; i--){
+    o = (char*)s + SLABHDR + i*c->size;
+    *(void**)o = s->free;
+    s->free = o;
+  }
+  partial_add(c, s);
+  c->nslab++;
+  return 0;
+}
+
+// Return obj to its slab. Frees the slab's page if
+// it becomes empty and is not the only partial slab.
+// Caller holds c->lock.
+static void
+slabput(struct kcache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  if(s->cache != c)
+    panic("kcache_free: wrong cache");
+  if(s->free == 0)
+    partial_add(c, s);
+  *(void**)obj = s->free;
+  s->free = obj;
+  s->inuse--;
+  c->ninuse--;
+  if(s->inuse == 0 && s->next != s){
+    partial_remove(c, s);
+    c->nslab--;
+    kfree(s);
+  }
+}
+
+// Take one object from the slabs.
+// Caller holds c->lock.
+static void*
+slabget(struct kcache *c)
+{
+  struct slab *s;
+  void *obj;
+
+  if(c->partial == 0 && slabgrow(c) < 0)
+    return 0;
+  s = c->partial;
+  obj = s->free;
+  s->free = *(void**)obj;
+  s->inuse++;
+  c->ninuse++;
+  if(s->free == 0)
+    partial_remove(c, s);
+  return obj;
+}
+
+// Allocate a zeroed object from cache c. If there is no
+// memory for another slab, take it from cached file pages
+// that nothing maps. Returns 0 if out of memory.
+void*
+kcache_alloc(struct kcache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  do {
+    if(c->perslab < MAGSIZE){
+      // no magazines (see the top of this file).
+      acquire(&c->lock);
+      obj = slabget(c);
+      release(&c->lock);
+      continue;
+    }
+    push_off();
+    m = &c->mag[cpuid()];
+    acquire(&m->lock);
+    if(m->n == 0){
+      // refill from the slabs with objects free, growing the
+      // cache only if there are none: a slab that only a
+      // magazine's objects keep would be wasted memory.
+      acquire(&c->lock);
+      while(m->n < MAGSIZE/2 && (m->n == 0 || c->partial) &&
+            (obj = slabget(c)) != 0)
+        m->obj[m->n++] = obj;
+      release(&c->lock);
+    }
+    obj = m->n > 0 ? m->obj[--m->n] : 0;
+    release(&m->lock);
+    pop_off();
+  } while(obj == 0 && pcachereclaim(1) > 0);
+
+  if(obj)
+    memset(obj, 0, c->size);
+  return obj;
+}
+
+// Return obj to cache c.
+void
+kcache_free(struct kcache *c, void *obj)
+{
+  struct magazine *m;
+
+  if(c->perslab < MAGSIZE){
+    // no magazines (see the top of this file).
+    acquire(&c->lock);
+    slabput(c, obj);
+    release(&c->lock);
+    return;
+  }
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2)
+      slabput(c, m->obj[--m->n]);
+    release(&c->lock);
+  }
+  m->obj[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+}
+
+// Free the slabs that hold no object in use, for when memory
+// is short: first every CPU's magazines go back to the slabs,
+// then the one empty slab slabput() may have kept in each
+// cache goes too. Returns the number of pages freed.
+int
+kcachereclaim(void)
+{
+  struct kcache *c;
+  struct magazine *m;
+  struct slab *s;
+  int n = 0, nslab;
+
+  for(c = kcaches.cache; c < kcaches.cache + kcaches.n; c++){
+    for(m = c->mag; m < c->mag + NCPU; m++){
+      acquire(&m->lock);
+      acquire(&c->lock);
+      nslab = c->nslab;
+      while(m->n > 0)
+        slabput(c, m->obj[--m->n]);
+      n += nslab - c->nslab;
+      release(&c->lock);
+      release(&m->lock);
+    }
+    acquire(&c->lock);
+    if((s = c->partial) != 0 && s->inuse == 0){
+      // the only partial slab, or slabput() would have freed it.
+      partial_remove(c, s);
+      c->nslab--;
+      kfree(s);
+      n++;
+    }
+    release(&c->lock);
+  }
+  return n;
+}
+
+// Print object cache usage. For debugging.
+// Runs when user types ^P on console.
+void
+kcachedump(void)
+{
+  struct kcache *c;
+
+  for(c = kcaches.cache; c < kcaches.cache + kcaches.n; c++)
+    printf("kcache: %s size %d objects %d slabs %d\n",
+           c->name, c->size, c->ninuse, c->nslab);
+}
+
+// Allocate size bytes of zeroed kernel memory.
+// Returns 0 if it cannot be allocated.
+void*
+kmalloc(uint size)
+{
+  void *p;
+  int i;
+
+  for(i = 0; i < NKMCLASS; i++)
+    if(size <= (KMMIN << i))
+      return kcache_alloc(kmcache[i]);
+
+  // too big for a slab: a block of 2^i pages, which is
+  // page-aligned, unlike any slab object.
+  for(i = 0; ((uint64)PGSIZE << i) < size; i++)
+    ;
+  if((p = kalloc_pages(i)) != 0)
+    memset(p, 0, (uint64)PGSIZE << i);
+  return p;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *p)
+{
+  struct slab *s;
+
+  if(p == 0)
+    return;
+  if((uint64)p % PGSIZE == 0){
+    kfree_pages(p, korder(p));
+    return;
+  }
+  s = (struct slab*)PGROUNDDOWN((uint64)p);
+  kcache_free(s->cache, p);
+}
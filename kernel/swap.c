@@ -0,0 +1,305 @@
+// Swap space, for user pages pushed out of memory.
+//
+// The swap area is NSWAP page-sized slots on the disk,
+// starting at block SWAPSTART, just past the file system.
+// A swapped-out page's PTE has PTE_V clear, PTE_SWAP set,
+// the slot number where the physical page number would
+// be, and its other flags kept, so that pagefault() can
+// bring the page back with the same permissions.
+//
+// When kalloc_user() finds memory exhausted, swapreclaim()
+// runs a clock hand over the processes' page tables:
+// a page whose PTE_A bit is set has been used since the
+// hand last passed, so the bit is cleared and the page
+// skipped; a page with PTE_A clear is written out.
+// Only private user pages (PG_USER, one reference) of
+// the current process and of processes that are not
+// running are taken, and their TLB entries flushed (the
+// current process's at once, others' via p->tlbflush), so
+// no CPU can go on using the page through a stale entry.
+// Kernel code that uses a user page's physical address
+// keeps the CPU while it does so (see uvmpage()), or holds
+// an extra reference.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "memstat.h"
+
+#define NRECLAIM 16  // pages swapped out per reclaim
+
+extern struct proc *allproc;
+extern int nprocs;
+
+struct {
+  struct spinlock lock;
+  uchar ref[NSWAP];   // PTEs that refer to each slot
+  uchar busy[NSWAP];  // slot is being written
+  int nused;          // slots with references or busy
+  int next;           // where to look for a free slot
+} swap;
+
+// Swap I/O goes through one buffer, a block at a time.
+struct {
+  struct sleeplock lock;
+  struct buf buf;
+} swapbuf;
+
+// The clock hand: next process and address to look at.
+// The sleep-lock also keeps reclaims one at a time.
+struct {
+  struct sleeplock lock;
+  struct proc *proc;   // 0 for the start of allproc
+  uint64 va;
+} hand;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swapbuf.lock, "swapbuf");
+  initsleeplock(&hand.lock, "swaphand");
+}
+
+// Allocate a swap slot with one reference, marked busy.
+// Returns -1 if swap is full. Caller holds swap.lock.
+static int
+slotalloc(void)
+{
+  int i, s;
+
+  for(i = 0; i < NSWAP; i++){
+    s = (swap.next + i) % NSWAP;
+    if(swap.ref[s] == 0 && !swap.busy[s]){
+      swap.ref[s] = 1;
+      swap.busy[s] = 1;
+      swap.nused++;
+      swap.next = (s + 1) % NSWAP;
+      return s;
+    }
+  }
+  return -1;
+}
+
+// Add a reference to slot s, for a PTE copied by fork.
+void
+swapdup(int s)
+{
+  acquire(&swap.lock);
+  if(swap.ref[s] == 0)
+    panic("swapdup");
+  swap.ref[s]++;
+  release(&swap.lock);
+}
+
+// Drop a reference to slot s. The slot is free once no
+// PTE refers to it and it is not being written.
+void
+swapfree(int s)
+{
+  acquire(&swap.lock);
+  if(swap.ref[s] == 0)
+    panic("swapfree");
+  if(--swap.ref[s] == 0 && !swap.busy[s])
+    swap.nused--;
+  release(&swap.lock);
+}
+
+// Read or write the page at pa from or to slot s.
+static void
+swapio(int s, char *pa, int write)
+{
+  struct buf *b = &swapbuf.buf;
+
+  acquiresleep(&swapbuf.lock);
+  for(int i = 0; i < PGSIZE/BSIZE; i++){
+    b->blockno = SWAPSTART + s*(PGSIZE/BSIZE) + i;
+    if(write)
+      memmove(b->data, pa + i*BSIZE, BSIZE);
+    virtio_disk_rw(b, write);
+    if(!write)
+      memmove(pa + i*BSIZE, b->data, BSIZE);
+  }
+  releasesleep(&swapbuf.lock);
+}
+
+// Look for a page of p to swap out, moving the clock hand.
+// If one is found, turn its PTE into a swap PTE for a new,
+// busy slot, and return the page and the slot. The page's
+// reference passes to the caller. Caller holds p->lock, so
+// a megapage is split with *spare, a page the caller
+// allocated beforehand, if there is one; it is then used up.
+static char*
+victim(struct proc *p, int *slot, char **spare)
+{
+  pte_t *pte;
+  uint64 va, size;
+  char *pa;
+  int s;
+
+  for(va = hand.va; va < p->sz; va += PGSIZE){
+    if((pte = walkleaf(p->pagetable, va, &size)) == 0){
+      // no page-table page, so nothing in this megapage range.
+      va = MEGAROUNDDOWN(va) + MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if(size != PGSIZE){
+      // split a megapage that has gone unused for a whole
+      // lap, so that its pages can be swapped one by one.
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        p->tlbflush = 1;
+        va = MEGAROUNDDOWN(va) + MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      if(*spare == 0){
+        va = MEGAROUNDDOWN(va) + MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      megasplit(pte, (pagetable_t)*spare);
+      *spare = 0;
+      pte = walkleaf(p->pagetable, va, &size);
+    }
+    if((*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+      continue;
+    pa = (char*)PTE2PA(*pte);
+    if(kgetclass(pa) != PG_USER || krefcnt(pa) != 1)
+      continue;
+    if(*pte & PTE_A){
+      // used recently; give it another chance. the TLB's
+      // copy of the PTE must go too, or the MMU won't set
+      // PTE_A again.
+      *pte &= ~PTE_A;
+      p->tlbflush = 1;
+      continue;
+    }
+
+    acquire(&swap.lock);
+    s = slotalloc();
+    release(&swap.lock);
+    if(s < 0)
+      return 0;
+    *pte = SWAP2PTE(s) | (PTE_FLAGS(*pte) & ~(PTE_V|PTE_A|PTE_D)) | PTE_SWAP;
+    p->tlbflush = 1;
+    // the kernel may be using the current process's
+    // mappings, to copy to or from user memory.
+    proctlbflush(p->pagetable, &va, 1);
+    hand.va = va + PGSIZE;
+    *slot = s;
+    return pa;
+  }
+  return 0;
+}
+
+// Write up to n user pages out to swap, and free them.
+// Returns how many were freed.
+int
+swapreclaim(int n)
+{
+  struct proc *p;
+  char *pa, *spare = 0;
+  int s, freed = 0, idle = 0;
+
+  acquiresleep(&hand.lock);
+  // each process may need two visits: one to clear PTE_A
+  // bits, and one to find them still clear.
+  while(freed < n && idle < 2*nprocs){
+    if(hand.proc == 0)
+      hand.proc = allproc;
+    p = hand.proc;
+    pa = 0;
+    // a page-table page for splitting a megapage, which
+    // victim() can't allocate with p->lock held.
+    if(spare == 0)
+      spare = kalloc();
+    acquire(&p->lock);
+    if((p == myproc() || p->state == SLEEPING || p->state == RUNNABLE) &&
+       p->pagetable)
+      pa = victim(p, &s, &spare);
+    release(&p->lock);
+
+    if(pa == 0){
+      hand.proc = p->next;
+      hand.va = 0;
+      idle++;
+      continue;
+    }
+
+    // the PTE no longer maps pa, so the page can't change
+    // while it is being written.
+    swapio(s, pa, 1);
+    acquire(&swap.lock);
+    swap.busy[s] = 0;
+    if(swap.ref[s] == 0)
+      swap.nused--;   // unmapped while being written
+    wakeup(&swap.busy[s]);
+    release(&swap.lock);
+    kfree(pa);
+    freed++;
+  }
+  releasesleep(&hand.lock);
+  if(spare)
+    kfree(spare);
+  return freed;
+}
+
+// Bring the page that the swap PTE *pte refers to back
+// into memory. Returns 0 on success, -1 if out of memory.
+int
+swapin(pte_t *pte)
+{
+  int s = PTE2SWAP(*pte);
+  char *mem;
+
+  // if the page is still being written out, wait for it.
+  acquire(&swap.lock);
+  while(swap.busy[s])
+    sleep(&swap.busy[s], &swap.lock);
+  release(&swap.lock);
+
+  if((mem = kalloc_user(0, 1)) == 0)
+    return -1;
+  swapio(s, mem, 0);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V;
+  swapfree(s);
+  return 0;
+}
+
+// Allocate a page for user memory, zeroed if zero is set.
+// If memory is exhausted, drop cached file pages that no one
+// maps and free object-cache slabs that hold no objects in
+// use, and, if maysleep is set, push other processes' pages
+// out to swap, and try again. Pushing pages out sleeps; a
+// caller that holds a spin-lock, or that only wants the page
+// to read ahead, passes 0. Returns 0 on failure.
+void*
+kalloc_user(int zero, int maysleep)
+{
+  char *mem;
+
+  for(;;){
+    mem = zero ? kalloc_zeroed() : kalloc();
+    if(mem){
+      ksetclass(mem, PG_USER);
+      return mem;
+    }
+    if(pcachereclaim(NRECLAIM) == 0 && kcachereclaim() == 0 &&
+       (!maysleep || swapreclaim(NRECLAIM) == 0))
+      return 0;
+  }
+}
+
+// Report swap usage.
+void
+swapstat(struct memstat *ms)
+{
+  ms->swaptotal = NSWAP;
+  ms->swapused = swap.nused;
+}
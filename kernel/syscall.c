@@ -106,6 +106,9 @@ extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_madvise(void);
 
 
 static uint64 (*syscalls[])(void) = {
@@ -132,6 +135,9 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_mmap]    sys_mmap,
 [SYS_munmap]  sys_munmap,
+[SYS_memstat] sys_memstat,
+[SYS_msync]   sys_msync,
+[SYS_madvise] sys_madvise,
 };
 
 void
@@ -21,4 +21,7 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_mmap   22
-#define SYS_munmap 23
\ No newline at end of file
+#define SYS_munmap 23
+#define SYS_memstat 24
+#define SYS_msync  25
+#define SYS_madvise 26
@@ -8,6 +8,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -322,6 +323,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program's text can't be written (see itextdup()).
+  if(ip->ntext > 0 && (omode & (O_WRONLY|O_RDWR|O_TRUNC))){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -415,13 +423,17 @@ sys_chdir(void)
 uint64
 sys_exec(void)
 {
-  char path[MAXPATH], *argv[MAXARG];
-  int i;
+  char path[MAXPATH], *argv[MAXARG], *buf;
+  int i, n;
   uint64 uargv, uarg;
 
   if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
     return -1;
   }
+  // fetch each argument into a scratch page, then
+  // keep only as much as it needs.
+  if((buf = kalloc()) == 0)
+    return -1;
   memset(argv, 0, sizeof(argv));
   for(i=0;; i++){
     if(i >= NELEM(argv)){
@@ -434,23 +446,26 @@ sys_exec(void)
       argv[i] = 0;
       break;
     }
-    argv[i] = kalloc();
-    if(argv[i] == 0)
+    if((n = fetchstr(uarg, buf, PGSIZE)) < 0)
       goto bad;
-    if(fetchstr(uarg, argv[i], PGSIZE) < 0)
+    argv[i] = kmalloc(n + 1);
+    if(argv[i] == 0)
       goto bad;
+    memmove(argv[i], buf, n + 1);
   }
+  kfree(buf);
 
   int ret = exec(path, argv);
 
   for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+    kmfree(argv[i]);
 
   return ret;
 
  bad:
+  kfree(buf);
   for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+    kmfree(argv[i]);
   return -1;
 }
 
@@ -485,24 +500,17 @@ sys_pipe(void)
   return 0;
 }
 
-//遍历找一个没用过的vma
- static int mapalloc()
- {
-   struct proc *p = myproc();
-   for(int i = 0; i < 16; i ++)
-   {
-     if(p->vmas[i].used == 0)
-     {
-       p->vmas[i].used = 1;
-       return i;
-     }
-   }
-   return -1;
- }
-
+// Can [addr, addr+len) of p's memory hold an mmap() region?
+// It must be page-aligned, above the heap and in user memory.
+static int
+mmaprange(struct proc *p, uint64 addr, uint64 len)
+{
+  return addr % PGSIZE == 0 && addr >= PGROUNDUP(p->sz) &&
+         uvmrange(addr, len);
+}
 
 uint64 sys_mmap(void){
-    uint64 addr;
+    uint64 addr, len;
     int length;
     int prot, flags, fd, off;
     struct file* f; //全部的传入参数
@@ -512,62 +520,141 @@ uint64 sys_mmap(void){
       return error;
     if(argint(2, &prot) < 0 || argint(3, &flags) < 0)
       return error;
-    if(argfd(4, &fd, &f) < 0 || argint(5, &off) < 0)
+    // an anonymous mapping has no file; fd is ignored.
+    f = 0;
+    if(!(flags & MAP_ANONYMOUS) && argfd(4, &fd, &f) < 0)
+      return error;
+    if(argint(5, &off) < 0)
       return error;
-    if(!f->writable && (prot & PROT_WRITE) && (flags == MAP_SHARED))
+    if(f && f->type != FD_INODE)
       return error;
+    if(f && !f->writable && (prot & PROT_WRITE) && (flags & MAP_SHARED))
+      return error;
+    if(f == 0)
+      off = 0;
 
     struct proc *p = myproc();
-    int idx = mapalloc();//找到一个空闲的
-    if(idx == -1)
+    struct vma *v;
+    // the file's pages are mapped whole, from the page cache.
+    if(off < 0 || off % PGSIZE != 0 || length <= 0)
+      return error;
+    len = PGROUNDUP(length);
+    // MAP_FIXED puts the region at addr, replacing what is
+    // mapped there; otherwise addr is a hint, used if the
+    // region fits there.
+    if(flags & MAP_FIXED){
+      if(!mmaprange(p, addr, len))
+        return error;
+    } else if(!mmaprange(p, addr, len) || vmaoverlap(p, addr, addr + len)){
+      if((addr = vmaplace(p, len)) == 0)
+        return error;
+    }
+    if((v = vmaalloc()) == 0)
       return error; //满了就另说
-    p->vmas[idx].file = f;
-    p->vmas[idx].flags = flags;
-    p->vmas[idx].offset = off;  
-    p->vmas[idx].prot = prot;
-    p->vmas[idx].length = length;
-    p->vmas[idx].st =  PGROUNDUP(p->sz);
-    p->vmas[idx].st =  PGROUNDUP(p->sz) + PGROUNDUP(length);
-    p->sz = PGROUNDUP(length) + PGROUNDUP(p->sz);
-    filedup(f);
-    return p->vmas[idx].st;
+    // a running program's text can't be written (see
+    // itextdup()); vmaclose() drops the count.
+    if(f && (flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+       iwmapdup(f->ip) < 0){
+      vmaclose(v);
+      return error;
+    }
+    v->file = f;
+    if(f)
+      filedup(f);
+    v->flags = flags;
+    v->offset = off;  
+    v->prot = prot;
+    v->length = length;
+    v->filesz = f ? length : 0;
+    v->st = addr;
+    v->ed = addr + len;
+    if(f == 0 && (flags & MAP_SHARED) &&
+       (v->shm = shmalloc(len / PGSIZE)) == 0){
+      vmaclose(v);
+      return error;
+    }
+    if((flags & MAP_FIXED) && vmaunmap(p, addr, addr + len) < 0){
+      vmaclose(v);
+      return error;
+    }
+    vmainsert(p, v);
+    return v->st;
 
 }
 
- uint64 sys_munmap(void)
- {
-   uint64 addr;
-   int length;
-   if(argaddr(0, &addr) < 0 || argint(1, &length) < 0)
-     return -1;
-   struct proc* p = myproc();
-   
-   // 查找解除映射的映射区，返回对应vma结构体的索引
-   int idx = findvma(addr);
-   // 查找失败
-   if(idx < 0)
-     return -1;
-   // 如果映射区为MAP_SHARED，那么取消映射时，需要将修改的数据写回文件
-   if(p->vmas[idx].flags & MAP_SHARED)
-     filewrite(p->vmas[idx].file, addr, length);
-   // 取消映射
-   uvmunmap(p->pagetable, addr, PGROUNDUP(length) / PGSIZE, 1);
-   // p->vmas[idx].st == addr的取消映射情况，即方式②
-   // 取消映射之后，需要将映射区的起始地址向上移动
-   // p->vmas[idx].st += PGROUNDUP(length)
-   // 测试用例中length都是4K(一页)的整数倍
-   // 这样处理的原因便于exit()取消映射时操作
-   if(addr == p->vmas[idx].st)
-     p->vmas[idx].st += PGROUNDUP(length);
-   
-   // 取消映射之后，映射区长度减少
-   p->vmas[idx].length -= length;
-   // 如果映射区长度为0，没有了映射区，文件引用计数减1，清空对应的vmas结构体
-   if(p->vmas[idx].length == 0)
-   {
-     fileclose(p->vmas[idx].file);
-     memset((void*)&p->vmas[idx], 0, sizeof(p->vmas[idx]));
-   }
-   
-   return 0;
- }
\ No newline at end of file
+// Unmap [addr, addr+length), which may be any part of
+// one or more regions; a region with a hole made in its
+// middle becomes two.
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int length;
+  struct proc *p = myproc();
+
+  if(argaddr(0, &addr) < 0 || argint(1, &length) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || length <= 0 ||
+     vmaoverlap(p, addr, addr + length) == 0)
+    return -1;
+  return vmaunmap(p, addr, addr + PGROUNDUP((uint64)length));
+}
+
+// Write back the changed pages of the MAP_SHARED
+// mappings in [addr, addr+length).
+uint64
+sys_msync(void)
+{
+  uint64 addr;
+  int length;
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &length) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || length <= 0 || vmaoverlap(p, addr, addr + length) == 0)
+    return -1;
+  for(v = vmaafter(p, addr); v && v->st < addr + length; v = vmaafter(p, v->ed))
+    vmasync(p, v, addr, addr + length);
+  return 0;
+}
+
+// Tell the kernel how the mapped memory [addr, addr+length)
+// will be used. MADV_WILLNEED reads its file pages in, and
+// MADV_DONTNEED drops its pages, before returning: there is
+// no kernel thread to read in the background. MADV_NORMAL,
+// MADV_RANDOM and MADV_SEQUENTIAL set how faults read ahead
+// in the range; a region it covers only part of is split at
+// its edges.
+uint64
+sys_madvise(void)
+{
+  uint64 addr, ed;
+  int length, advice;
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &length) < 0 || argint(2, &advice) < 0)
+    return -1;
+  if(addr % PGSIZE != 0 || length <= 0 || vmaoverlap(p, addr, addr + length) == 0)
+    return -1;
+  if(advice < MADV_NORMAL || advice > MADV_DONTNEED)
+    return -1;
+  ed = addr + PGROUNDUP((uint64)length);
+  for(v = vmaafter(p, addr); v && v->st < ed; v = vmaafter(p, v->ed)){
+    if(advice == MADV_WILLNEED){
+      vmaprefetch(v, addr, ed);
+    } else if(advice == MADV_DONTNEED){
+      vmadrop(p, v, addr, ed);
+    } else if(v->st < addr){
+      // the next time round is the part from addr on.
+      if(vmasplit(p, v, addr) < 0)
+        return -1;
+    } else {
+      if(ed < v->ed && vmasplit(p, v, ed) < 0)
+        return -1;
+      v->advice = advice;
+    }
+  }
+  return 0;
+}
@@ -95,3 +95,14 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+uint64
+sys_memstat(void)
+{
+  uint64 ms, pm;
+  int n;
+
+  if(argaddr(0, &ms) < 0 || argaddr(1, &pm) < 0 || argint(2, &n) < 0)
+    return -1;
+  return memstat(ms, pm, n);
+}
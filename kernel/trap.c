@@ -9,11 +9,13 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "memstat.h"
 
 struct spinlock tickslock;
 uint ticks;
 
 extern char trampoline[], uservec[], userret[];
+extern char ucopy_begin[], ucopy_end[], ucopyfault[];  // ucopy.S
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
@@ -33,44 +35,287 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
- int findvma(uint64 va)
- {
-   struct proc* p = myproc();
-   for(int i = 0; i < 16; i ++)
-   {
-     uint64 st = p->vmas[i].st, ed = p->vmas[i].ed;
-     if(st <= va && va < ed)
-       return i;
-   }
-   return -1;
- }
-
-
-
-uint64 mmapalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int prot)
- {
-     if(newsz < oldsz)
-       return oldsz;
-     for(uint64 a = oldsz; a < newsz; a += PGSIZE)
-     {
-       char* mem = (char*)kalloc();
-       if(mem == 0)
-       {
-         uvmdealloc(pagetable, a, oldsz);
-         return 0;
-       }
-       memset(mem, 0, PGSIZE);
-       
-       if(mappages(pagetable, a, PGSIZE, (uint64)mem, prot) != 0)
-       {
-           kfree((void*)mem);
-           uvmdealloc(pagetable, a, oldsz);
-           return 0;
-       }
-     }
-     //uvmalloc();
-     return newsz;   
- }
+// Return a private page holding the n bytes of ip at file
+// offset off, copied from the page cache, with zeros after
+// them. fill is as for pcacheget().
+static char*
+segpage(struct inode *ip, uint off, uint n, int fill)
+{
+  char *mem, *pa;
+  uint o, m;
+
+  if((mem = kalloc_user(1, fill == PC_READ)) == 0)
+    return 0;
+  for(o = 0; o < n; o += m){
+    m = PGSIZE - (off + o) % PGSIZE;
+    if(m > n - o)
+      m = n - o;
+    if((pa = pcacheget(ip, PGROUNDDOWN(off + o), fill)) == 0){
+      kfree(mem);
+      return 0;
+    }
+    memmove(mem + o, pa + (off + o) % PGSIZE, m);
+    kfree(pa);
+  }
+  return mem;
+}
+
+// Map the page at va of region v: an mmap region, or a
+// segment of the program that exec() left to be paged in.
+// An anonymous region has filesz 0, so all its pages read
+// as zeros, unless it is shared, in which case they are
+// its struct shm's.
+// The page is read from the file, and with it the other
+// pages of its FAULTAROUND-page window whose file blocks are
+// already in the buffer cache, so that a scan through cached
+// data faults once per window. madvise() changes the window:
+// MADV_RANDOM maps just the page, and MADV_SEQUENTIAL reads in
+// the READAHEAD pages from va on, in this fault, since there
+// is no kernel thread to read them in the background, and
+// drops those the scan has left behind. Pages of the region
+// past its filesz bytes (past the end of the file, or the
+// bss) read as zeros, and need no I/O; a read of a bss page maps the
+// zero page. The other pages are the page cache's, shared
+// with the other processes running the program or mapping
+// the file. A MAP_SHARED region maps them writable, so that
+// it sees other mappings' stores, and read() and write(), at
+// once; a program segment or MAP_PRIVATE region maps them
+// copy-on-write, so a page is copied only when first written.
+// A segment page that doesn't line up with a page of the
+// file, or that holds the end of the segment, is not shared:
+// it is a private copy of the segment's bytes, with zeros
+// after them.
+static int
+vmafault(struct proc *p, struct vma *v, uint64 va, int write)
+{
+  struct inode *ip = v->file ? v->file->ip : v->ip;
+  uint64 a, start, end, size, n;
+  uint off;
+  pte_t *pte;
+  char *mem;
+  int perms, shperms, pgperms, locked, nolock, fill, r = 0;
+
+  perms = PTE_U;
+  if(v->prot & PROT_READ)
+    perms |= PTE_R;
+  // W without R is a reserved PTE encoding, whose every
+  // access faults; a writable page is readable too.
+  if(v->prot & PROT_WRITE)
+    perms |= PTE_R|PTE_W;
+  if(v->prot & PROT_EXEC)
+    perms |= PTE_X;
+  shperms = perms;
+  if(perms & PTE_W)
+    shperms = (perms & ~PTE_W) | PTE_COW;
+  if(uvmwalk(p->pagetable, va) < 0)
+    return -1;
+
+  if(v->shm){
+    // shared anonymous memory: the page all its mappers map.
+    if((mem = shmpage(v->shm, (v->offset + (va - v->st)) / PGSIZE)) == 0)
+      return -1;
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perms) != 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+
+  if(va - v->st >= v->filesz){
+    // all zeros.
+    if(v->file == 0 && !write)
+      return zeromap(p->pagetable, va, perms);
+    if((mem = kalloc_user(1, 1)) == 0)
+      return -1;
+    if(v->file)
+      ksetclass(mem, PG_MMAP);
+    if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perms) != 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+
+  if(v->advice == MADV_RANDOM){
+    start = va;
+    end = va + PGSIZE;
+  } else if(v->advice == MADV_SEQUENTIAL){
+    start = va;
+    end = va + READAHEAD*PGSIZE;
+  } else {
+    start = va - va % (FAULTAROUND*PGSIZE);
+    end = start + FAULTAROUND*PGSIZE;
+  }
+  if(start < v->st)
+    start = v->st;
+  if(end > v->st + v->filesz)
+    end = PGROUNDUP(v->st + v->filesz);
+
+  // the fault may come from a copy to or from user memory
+  // that read() or write() does with an inode locked. if it
+  // is this one, go ahead. if it is another, locking this
+  // one could deadlock with a process that holds this one
+  // and faults on a mapping of the other, so only pages
+  // already in the page cache are mapped. fileread() and
+  // filewrite() fault the buffer in first, so this is rare;
+  // if va itself isn't cached, the copy fails, and they
+  // fault it in from p->faultva once the lock is dropped.
+  locked = holdingsleep(&ip->lock);
+  nolock = !locked && p->nilock > 0;
+  if(!locked && !nolock)
+    ilock(ip);
+  for(a = start; a < end; a += PGSIZE){
+    pte = walkleaf(p->pagetable, a, &size);
+    if(pte && (*pte & (PTE_V|PTE_SWAP)))
+      continue;   // already there
+    off = v->offset + (a - v->st);
+    n = v->filesz - (a - v->st);
+    if(n > PGSIZE)
+      n = PGSIZE;
+    // an mmap()ed file's pages are whole pages of it.
+    if(v->file)
+      n = PGSIZE;
+    if(nolock)
+      fill = PC_CACHED;
+    else if(a == va)
+      fill = PC_READ;
+    else if(v->advice == MADV_SEQUENTIAL || icached(ip, off, n))
+      fill = PC_AHEAD;
+    else
+      fill = PC_CACHED;
+    if(off % PGSIZE == 0 && n == PGSIZE){
+      mem = pcacheget(ip, off, fill);
+      pgperms = (v->flags & MAP_SHARED) ? perms : shperms;
+    } else {
+      mem = segpage(ip, off, n, fill);
+      pgperms = perms;
+    }
+    if(mem == 0){
+      if(a == va){
+        if(nolock)
+          p->faultva = va;
+        r = -1;
+        break;
+      }
+      continue;
+    }
+    if(mappages(p->pagetable, a, PGSIZE, (uint64)mem, pgperms) != 0){
+      kfree(mem);
+      if(a == va)
+        r = -1;
+      break;
+    }
+  }
+  if(!locked && !nolock)
+    iunlock(ip);
+  // a sequential scan won't be back: drop the pages of the
+  // window before last, if the region is read-only, so that
+  // they can't hold changes that would need writing back.
+  if(r == 0 && v->advice == MADV_SEQUENTIAL && !(v->prot & PROT_WRITE) &&
+     va >= v->st + 2*READAHEAD*PGSIZE)
+    vmadrop(p, v, va - 2*READAHEAD*PGSIZE, va - READAHEAD*PGSIZE);
+  return r;
+}
+
+// Is [va, va+MEGAPGSIZE) all heap of process p?
+static int
+megaheap(struct proc *p, uint64 va)
+{
+  if(va < p->stacktop || va + MEGAPGSIZE > p->sz)
+    return 0;
+  return vmaoverlap(p, va, va + MEGAPGSIZE) == 0;
+}
+
+// Fix the PTE for a fault on user page va of p, for
+// pagefault(). The fault may be spurious: the PTE may
+// already allow the access, if the TLB held an older one.
+static int
+fixfault(struct proc *p, pagetable_t pagetable, uint64 va, int access)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint64 size;
+  char *mem;
+  int write = access == PTE_W;
+
+  pte = walkleaf(pagetable, va, &size);
+  if(pte && (*pte & PTE_V) == 0 && (*pte & PTE_SWAP))
+    return swapin(pte);
+  if(pte && (*pte & PTE_V)){
+    // mapped already; only copy-on-write can be fixed.
+    // a PTE with W but not R faults on every access, so
+    // calling it fixed would have the access fault forever.
+    if((*pte & (PTE_U|access)) == (PTE_U|access) &&
+       (*pte & (PTE_R|PTE_W)) != PTE_W)
+      return 0;
+    if(write && (*pte & PTE_COW))
+      return cowfault(pagetable, va);
+    return -1;
+  }
+
+  if((v = vmafind(p, va)) != 0)
+    return vmafault(p, v, va, write);
+
+  if(va >= p->sz)
+    return -1;
+  // lazily allocated heap or stack. a write may back a whole
+  // 2-megabyte stretch of it with one megapage if possible.
+  if(write && megaheap(p, MEGAROUNDDOWN(va)) &&
+     megamap(pagetable, MEGAROUNDDOWN(va), PTE_W|PTE_R|PTE_U) == 0)
+    return 0;
+  // the page-table page first: with memory exhausted,
+  // mappages() can't allocate one.
+  if(uvmwalk(pagetable, va) < 0)
+    return -1;
+  // until it is written, a page that is only read can be
+  // the zero page.
+  if(!write)
+    return zeromap(pagetable, va, PTE_W|PTE_R|PTE_U);
+  if((mem = kalloc_user(1, 1)) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Handle a fault on user address va in the current
+// process's page table: a write to a copy-on-write
+// page, a page that was swapped out, a heap page that
+// sbrk() reserved or a stack page that exec() did, but
+// nothing has touched yet, a page of the program that
+// exec() has not read in, or an mmap region. Called from
+// usertrap() and, for system call arguments, from
+// copyin()/copyout(). access is the PTE bit the faulting
+// access needs: PTE_R, PTE_W or PTE_X. Returns 0 once the
+// page is mapped, -1 if the access is not allowed.
+// May sleep, to read a page in or make room for one, so the
+// caller must hold no spin-locks.
+int
+pagefault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc();
+  int r;
+
+  if(p == 0 || pagetable != p->pagetable || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  r = fixfault(p, pagetable, va, access);
+  // the TLB may hold the old, read-only or invalid, PTE.
+  // it goes only now that the new one is in place, or
+  // the MMU could load the old one again in between. the
+  // fault may have come from the kernel, through a kernel
+  // page table that has yet to map va's range.
+  if(r == 0){
+    if(kvmsync(p->kpagetable, pagetable, va))
+      proctlbflush(pagetable, 0, -1);
+    else
+      proctlbflush(pagetable, &va, 1);
+  }
+  return r;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -109,48 +354,19 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
-  } else if(r_scause() == 13 || r_scause() == 15) {
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    // page fault. fixing it may read a file and sleep,
+    // so enable interrupts once scause/stval are read.
+    uint64 scause = r_scause();
     uint64 va = r_stval();
-     
-     int idx = findvma(va);
-     if(idx >= 0)
-     {
-       // 设置映射区page的权限
-       int perms = PTE_U;
-       int prot = p->vmas[idx].prot;
-       if(prot & PROT_READ) 
-         perms |= PTE_R;
-       if(prot & PROT_WRITE)
-         perms |= PTE_W;
-       if(prot & PROT_EXEC)
-         perms |= PTE_X;
-       uint64 st = p->vmas[idx].st, ed = p->vmas[idx].ed;
-     
-       // 映射区可能需要多个物理，所以分配多个物理页。
-       // 分配之后虚拟地址与物理地址之间建立映射关系。
-       if((ed = mmapalloc(p->pagetable, st, ed, perms)) == 0)
-         printf("allocate error");
-       
-       struct file *mfile = p->vmas[idx].file;
-       
-       // 将文件数据读入到物理页，但是读取时需要持有锁。
-       // 不允许其他的进程向当前正在读取的文件进行写操作。
-       ilock(mfile->ip);
-       readi(mfile->ip, 1, p->vmas[idx].st, 0, p->vmas[idx].length);
-       iunlock(mfile->ip);
-     }
-     else
-       p->killed = 1;
-
-
-
-
-
-  }
-  
-  
-  
-  else {
+    intr_on();
+    int access = scause == 15 ? PTE_W : scause == 12 ? PTE_X : PTE_R;
+    if(pagefault(p->pagetable, va, access) < 0){
+      printf("usertrap(): page fault %p pid=%d\n", scause, p->pid);
+      printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+      p->killed = 1;
+    }
+  } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
     p->killed = 1;
@@ -184,7 +400,6 @@ usertrapret(void)
 
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
-  p->trapframe->kernel_satp = r_satp();         // kernel page table
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -201,8 +416,12 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the satp for the kernel, p's kernel page
+  // table, and for user space, p's page table: both with p's
+  // ASID, which may have changed.
+  uint64 satp = procsatp(p);
+  p->trapframe->kernel_satp = satp;
+  satp = MAKE_SATP_ASID(p->pagetable, satp >> SATP_ASIDSHIFT);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -226,15 +445,27 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) && sepc >= (uint64)ucopy_begin &&
+     sepc < (uint64)ucopy_end && uvmrange(r_stval(), 1)){
+    // a copy in ucopy.S met a user page that is missing or
+    // read-only. make it return -1; the caller will let
+    // pagefault() fix the page, and try again.
+    sepc = (uint64)ucopyfault;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // give up the CPU if this is a timer interrupt. the
+  // interrupt may have come in the middle of a ucopy.S copy,
+  // with SUM set; swtch() doesn't save sstatus, so clear SUM
+  // so that the threads that run in between can't touch user
+  // memory. the w_sstatus() below sets it again.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING){
+    w_sstatus(r_sstatus() & ~SSTATUS_SUM);
     yield();
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -3,35 +3,51 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
+#include "memstat.h"
 
 /*
  * the kernel's page table.
  */
 pagetable_t kernel_pagetable;
 
+// the number of ASIDs that satp can hold; 1 if ASIDs
+// are not implemented. the kernel uses ASID 0.
+int nasid;
+
+// a page of zeros, which user memory that has been read but
+// never written maps copy-on-write (see zeromap()).
+char *zeropage;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+#define FREEBATCH 32  // pages handed to kfreebatch() at a time
+#define NFLUSHVA 16   // addresses to flush one by one, at most
+
+void freewalk(pagetable_t);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
 {
   pagetable_t kpgtbl;
 
-  kpgtbl = (pagetable_t) kalloc();
-  memset(kpgtbl, 0, PGSIZE);
+  kpgtbl = (pagetable_t) kalloc_zeroed();
+  ksetclass(kpgtbl, PG_PGTBL);
 
   // uart registers
-  kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(kpgtbl, UART0, UART0 - KDEVBASE, PGSIZE, PTE_R | PTE_W);
 
   // virtio mmio disk interface
-  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(kpgtbl, VIRTIO0, VIRTIO0 - KDEVBASE, PGSIZE, PTE_R | PTE_W);
 
   // PLIC
-  kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
+  kvmmap(kpgtbl, PLIC, PLIC - KDEVBASE, 0x400000, PTE_R | PTE_W);
 
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
@@ -43,9 +59,8 @@ kvmmake(void)
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // map kernel stacks
-  proc_mapstacks(kpgtbl);
-  
+  // kernel stacks are mapped as processes are made (see newproc()).
+
   return kpgtbl;
 }
 
@@ -54,6 +69,8 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  if((zeropage = kalloc_zeroed()) == 0)
+    panic("kvminit: zeropage");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -61,13 +78,20 @@ kvminit(void)
 void
 kvminithart()
 {
+  // the ASID bits that are implemented keep
+  // the ones written to them.
+  w_satp(MAKE_SATP_ASID(kernel_pagetable, SATP_ASIDMASK));
+  nasid = ((r_satp() >> SATP_ASIDSHIFT) & SATP_ASIDMASK) + 1;
   w_satp(MAKE_SATP(kernel_pagetable));
   sfence_vma();
 }
 
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages. A megapage that
+// covers va is split first, so the PTE always maps a
+// single 4096-byte page; returns 0 if that runs out of
+// memory.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -77,6 +101,7 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+// A leaf PTE at level 1 maps a 2-megabyte megapage.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
@@ -85,18 +110,109 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) && (*pte & (PTE_R|PTE_W|PTE_X)) && megasplit(pte, 0) < 0)
+      return 0;
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
+      ksetclass(pagetable, PG_PGTBL);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
   return &pagetable[PX(0, va)];
 }
 
+// Like walk(pagetable, va, 0), but leave megapages alone:
+// return the leaf PTE that maps va, and set *size to the
+// number of bytes it maps. Returns 0 if there is no
+// page-table page for va.
+pte_t *
+walkleaf(pagetable_t pagetable, uint64 va, uint64 *size)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walkleaf");
+
+  for(int level = 2; level > 0; level--) {
+    pte = &pagetable[PX(level, va)];
+    if((*pte & PTE_V) == 0)
+      return 0;
+    if(*pte & (PTE_R|PTE_W|PTE_X)){
+      *size = MEGAPGSIZE;
+      return pte;
+    }
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  }
+  *size = PGSIZE;
+  return &pagetable[PX(0, va)];
+}
+
+// Return the address of the level-1 PTE for va, which is
+// either a megapage leaf or points to a level-0 page-table
+// page. If alloc!=0, create the level-1 page-table page.
+static pte_t *
+walkmega(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte = &pagetable[PX(2, va)];
+
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
+      return 0;
+    ksetclass(pagetable, PG_PGTBL);
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
+// Replace the megapage leaf *pte with a level-0 page-table
+// page that maps the same memory 4096 bytes at a time, with
+// the same permissions. The pages of a megapage are counted
+// one by one (see kalloc_split()), so no reference counts
+// change. The level-0 page is pagetable, if the caller has
+// allocated one, or else a new one. Returns -1 if out of memory.
+int
+megasplit(pte_t *pte, pagetable_t pagetable)
+{
+  uint64 pa = PTE2PA(*pte);
+  uint64 flags = PTE_FLAGS(*pte);
+
+  if(pagetable == 0 && (pagetable = (pagetable_t)kalloc()) == 0)
+    return -1;
+  ksetclass(pagetable, PG_PGTBL);
+  for(int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pagetable) | PTE_V;
+  return 0;
+}
+
+// Map a zeroed megapage at va, which must be aligned to
+// MEGAPGSIZE, if nothing in [va, va+MEGAPGSIZE) is mapped
+// yet. Returns 0 on success, -1 if the range is in use or
+// no 2-megabyte block of physical memory is free.
+int
+megamap(pagetable_t pagetable, uint64 va, int perm)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va % MEGAPGSIZE != 0)
+    panic("megamap: not aligned");
+  if((pte = walkmega(pagetable, va, 1)) == 0 || (*pte & PTE_V))
+    return -1;
+  if((mem = kalloc_split(MEGAORDER)) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    ksetclass(mem + i*PGSIZE, PG_USER);
+  memset(mem, 0, MEGAPGSIZE);
+  *pte = PA2PTE(mem) | perm | PTE_V;
+  return 0;
+}
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -104,29 +220,31 @@ uint64
 walkaddr(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  uint64 pa;
+  uint64 pa, size;
 
   if(va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkleaf(pagetable, va, &size);
   if(pte == 0)
     return 0;
   if((*pte & PTE_V) == 0)
     return 0;
   if((*pte & PTE_U) == 0)
     return 0;
-  pa = PTE2PA(*pte);
+  pa = PTE2PA(*pte) + (PGROUNDDOWN(va) & (size - 1));
   return pa;
 }
 
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// kernel mappings are global, so that the TLB keeps
+// them across switches to and from user page tables.
 void
 kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kpgtbl, va, sz, pa, perm) != 0)
+  if(mappages(kpgtbl, va, sz, pa, perm | PTE_G) != 0)
     panic("kvmmap");
 }
 
@@ -156,31 +274,257 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// A range of mappings being removed by unmaprange(). Pages to
+// free wait in a batch for kfreebatch(), and the addresses whose
+// TLB entries must go are noted, so that the TLB is flushed once,
+// at the end.
+//
+// memstat() walks other processes' page tables holding only
+// their p->lock, so when a process unmaps from its own page
+// table, the page-table pages that come free are freed with its
+// p->lock held; until then they stay intact, and a walk that
+// read a PTE before it was cleared can still follow it.
+struct unmap {
+  uint64 va, end;           // the range
+  int do_free;              // drop the references to the pages
+  int strict;               // panic if a page is not mapped
+  struct proc *p;           // lock to hold to free page-table pages, or 0
+  void *batch[FREEBATCH];
+  int n;
+  void *tables[FREEBATCH];  // page-table pages to free
+  int ntables;
+  uint64 flushva[NFLUSHVA]; // leaf mappings removed
+  int nflush;               // -1: flush the whole address space
+};
+
+static void
+unmapfree(struct unmap *u, void *pa)
+{
+  u->batch[u->n++] = pa;
+  if(u->n == FREEBATCH){
+    kfreebatch(u->batch, u->n);
+    u->n = 0;
+  }
+}
+
+// Free the page-table pages u has collected.
+static void
+unmaptables(struct unmap *u)
+{
+  if(u->ntables == 0)
+    return;
+  if(u->p)
+    acquire(&u->p->lock);
+  kfreebatch(u->tables, u->ntables);
+  if(u->p)
+    release(&u->p->lock);
+  u->ntables = 0;
+}
+
+static void
+unmaptable(struct unmap *u, void *pa)
+{
+  u->tables[u->ntables++] = pa;
+  if(u->ntables == FREEBATCH)
+    unmaptables(u);
+}
+
+static void
+unmapflush(struct unmap *u, uint64 va)
+{
+  if(u->nflush >= 0 && u->nflush < NFLUSHVA)
+    u->flushva[u->nflush++] = va;
+  else
+    u->nflush = -1;
+}
+
+// Remove the mappings in u's range from the page-table page pt
+// at the given level, whose first PTE maps address base. Each
+// page-table page in the range is visited once. A megapage that
+// the range covers is dropped whole (unmaprange() has split any
+// it only partly covers); a page-table page that the range
+// covers is freed too.
+static void
+unmapwalk(struct unmap *u, pagetable_t pt, int level, uint64 base)
+{
+  uint64 span = 1L << PXSHIFT(level);  // bytes mapped by one PTE
+  uint64 a, pa;
+  pte_t *pte;
+  int covered;
+
+  a = u->va > base ? u->va & ~(span-1) : base;
+  for(; a < u->end && a < base + 512*span; a += span){
+    pte = &pt[PX(level, a)];
+    covered = a >= u->va && a + span <= u->end;
+    if((*pte & PTE_V) == 0){
+      if(level == 0 && (*pte & PTE_SWAP)){
+        if(u->do_free)
+          swapfree(PTE2SWAP(*pte));
+        *pte = 0;
+      } else if(u->strict){
+        panic("uvmunmap: not mapped");
+      }
+      continue;
+    }
+    pa = PTE2PA(*pte);
+    if(*pte & (PTE_R|PTE_W|PTE_X)){
+      if(level == 0 || (level == 1 && covered)){
+        if(u->do_free && level == 0)
+          unmapfree(u, (void*)pa);
+        else if(u->do_free)
+          kfree_split((void*)pa, MEGAORDER);
+        *pte = 0;
+        unmapflush(u, a);
+        continue;
+      }
+      panic("unmapwalk: megapage");
+    } else if(level == 0){
+      panic("uvmunmap: not a leaf");
+    }
+    unmapwalk(u, (pagetable_t)pa, level-1, a);
+    if(covered){
+      // nothing is left in the page-table page. the TLB
+      // may cache non-leaf PTEs, which only a flush of
+      // the whole address space removes.
+      *pte = 0;
+      unmaptable(u, (void*)pa);
+      u->nflush = -1;
+    }
+  }
+}
+
+// If a megapage maps va without starting there, split it,
+// so that an unmap that starts or ends at va can remove
+// whole pages. Returns -1 if out of memory.
+static int
+splitat(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 size;
+
+  if(va % MEGAPGSIZE == 0 || va >= MAXVA)
+    return 0;
+  pte = walkleaf(pagetable, va, &size);
+  if(pte == 0 || size != MEGAPGSIZE || (*pte & PTE_V) == 0)
+    return 0;
+  return megasplit(pte, 0);
+}
+
+// Remove npages of mappings starting from va, visiting each
+// page-table page once, then invalidate the TLB entries of the
+// current process that they leave stale, and free the pages.
+// A megapage the range only partly covers is split first, so
+// that running out of memory for that leaves every mapping in
+// place. Returns 0 on success, -1 if out of memory.
+static int
+unmaprange(pagetable_t pagetable, uint64 va, uint64 npages, int do_free,
+           int strict)
+{
+  struct unmap u;
+
+  if((va % PGSIZE) != 0)
+    panic("uvmunmap: not aligned");
+  if(npages == 0)
+    return 0;
+  if(splitat(pagetable, va) < 0 || splitat(pagetable, va + npages*PGSIZE) < 0)
+    return -1;
+  u.va = va;
+  u.end = va + npages*PGSIZE;
+  u.do_free = do_free;
+  u.strict = strict;
+  u.n = 0;
+  u.ntables = 0;
+  u.nflush = 0;
+  // only the current process's page table is both in use
+  // and left to the caller to lock; exec() and wait() free
+  // others with p->lock held, or once no one can see them.
+  u.p = myproc();
+  if(u.p && (u.p->pagetable != pagetable || holding(&u.p->lock)))
+    u.p = 0;
+  unmapwalk(&u, pagetable, 2, 0);
+  if(u.nflush != 0)
+    proctlbflush(pagetable, u.flushva, u.nflush);
+  unmaptables(&u);
+  kfreebatch(u.batch, u.n);
+  return 0;
+}
+
 // Remove npages of mappings starting from va. va must be
 // page-aligned. The mappings must exist.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
-  pte_t *pte;
+  if(unmaprange(pagetable, va, npages, do_free, 1) < 0)
+    panic("uvmunmap: split");
+}
 
-  if((va % PGSIZE) != 0)
-    panic("uvmunmap: not aligned");
+// Like uvmunmap(), but for ranges that may be partly unmapped,
+// such as lazily allocated heap or mmap()ed regions, and that
+// may hold swapped-out pages. Returns 0 on success, or -1 if
+// out of memory, in which case nothing has been unmapped.
+int
+mmapunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  return unmaprange(pagetable, va, npages, do_free, 0);
+}
 
-  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
-    if(PTE_FLAGS(*pte) == PTE_V)
-      panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
-    }
-    *pte = 0;
-  }
+// Make a kernel page table for a process: the kernel's own
+// mappings, sharing the kernel's page-table pages, to which
+// kvmsync() adds the process's user memory, sharing its user
+// page table's. The kernel runs on it while it works for the
+// process, and reaches user memory directly through it; the
+// process's own page table maps nothing of the kernel but the
+// trampoline. Returns 0 if out of memory.
+pagetable_t
+kvmcreate(void)
+{
+  pagetable_t kpagetable;
+
+  kpagetable = (pagetable_t) kalloc_zeroed();
+  if(kpagetable == 0)
+    return 0;
+  ksetclass(kpagetable, PG_PGTBL);
+  // kernel text, data, RAM and devices; the kernel
+  // stacks and the trampoline.
+  kpagetable[PX(2, KERNBASE)] = kernel_pagetable[PX(2, KERNBASE)];
+  kpagetable[PX(2, TRAMPOLINE)] = kernel_pagetable[PX(2, TRAMPOLINE)];
+  return kpagetable;
+}
+
+// Free a process's kernel page table. The page-table pages
+// below its top one belong to the kernel or to the user
+// page table.
+void
+kvmfree(pagetable_t kpagetable)
+{
+  kfree((void*)kpagetable);
+}
+
+// Make kernel page table kpagetable map the user memory that
+// pagetable maps in va's top-level range, by sharing its
+// level-1 page-table page. A user page table keeps its
+// page-table pages until it is freed, so once shared, the PTE
+// stays right. Returns 1 if kpagetable changed, so that the
+// TLB may hold a stale entry for any address in the range.
+int
+kvmsync(pagetable_t kpagetable, pagetable_t pagetable, uint64 va)
+{
+  int i = PX(2, va);
+
+  if(!uvmrange(va, 1) || kpagetable[i] == pagetable[i])
+    return 0;
+  kpagetable[i] = pagetable[i];
+  return 1;
+}
+
+// Make kpagetable map the user memory of pagetable, and none
+// of any page table it mapped before, for exec().
+void
+kvmresync(pagetable_t kpagetable, pagetable_t pagetable)
+{
+  for(uint64 va = 0; va < UMMAPTOP; va += 1L << PXSHIFT(2))
+    kvmsync(kpagetable, pagetable, va);
 }
 
 // create an empty user page table.
@@ -189,10 +533,10 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
+  ksetclass(pagetable, PG_PGTBL);
   return pagetable;
 }
 
@@ -206,8 +550,8 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
+  ksetclass(mem, PG_USER);
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -222,15 +566,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(newsz < oldsz)
     return oldsz;
+  if(newsz > UMAXVA)
+    return 0;
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_user(1, 1);
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -243,7 +588,7 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size, or oldsz if out of memory.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -252,16 +597,18 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    // the heap is allocated lazily, so some pages may not be mapped.
+    if(mmapunmap(pagetable, PGROUNDUP(newsz), npages, 1) < 0)
+      return oldsz;
   }
 
   return newsz;
 }
 
-// Recursively free page-table pages.
-// All leaf mappings must already have been removed.
-void
-freewalk(pagetable_t pagetable)
+// Recursively collect page-table pages into batch,
+// handing full batches to kfreebatch().
+static void
+freewalk1(pagetable_t pagetable, void **batch, int *n)
 {
   // there are 2^9 = 512 PTEs in a page table.
   for(int i = 0; i < 512; i++){
@@ -269,13 +616,29 @@ freewalk(pagetable_t pagetable)
     if((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0){
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
-      freewalk((pagetable_t)child);
+      freewalk1((pagetable_t)child, batch, n);
       pagetable[i] = 0;
     } else if(pte & PTE_V){
       panic("freewalk: leaf");
     }
   }
-  kfree((void*)pagetable);
+  batch[(*n)++] = (void*)pagetable;
+  if(*n == FREEBATCH){
+    kfreebatch(batch, *n);
+    *n = 0;
+  }
+}
+
+// Recursively free page-table pages.
+// All leaf mappings must already have been removed.
+void
+freewalk(pagetable_t pagetable)
+{
+  void *batch[FREEBATCH];
+  int n = 0;
+
+  freewalk1(pagetable, batch, &n);
+  kfreebatch(batch, n);
 }
 
 // Free user memory pages,
@@ -324,8 +687,56 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   return -1;
 }
 
+static uint64
+rss1(pagetable_t pagetable, int level)
+{
+  uint64 n = 0;
+
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(pte & (PTE_R|PTE_W|PTE_X)){
+      if(pte & PTE_U)
+        n += 1L << (9*level);
+    } else if(level > 0){
+      n += rss1((pagetable_t)PTE2PA(pte), level-1);
+    }
+  }
+  return n;
+}
+
+// Count the user pages mapped in pagetable, a megapage
+// counting as the 512 pages it maps. User memory lies in
+// the top-level ranges below UMMAPTOP but the kernel's.
+uint64
+uvmrss(pagetable_t pagetable)
+{
+  uint64 n = 0;
+
+  for(int i = 0; i < PX(2, UMMAPTOP); i++)
+    if(i != PX(2, KERNBASE) && (pagetable[i] & PTE_V))
+      n += rss1((pagetable_t)PTE2PA(pagetable[i]), 1);
+  return n;
+}
+
+// Does [va, va+len) lie within user memory (see memlayout.h)?
+// The kernel must not be tricked into copying its own memory.
+int
+uvmrange(uint64 va, uint64 len)
+{
+  if(va < UMAXVA)
+    return len <= UMAXVA - va;
+  return va >= UMMAPBASE && va < UMMAPTOP && len <= UMMAPTOP - va;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
+// the kernel reaches pages without PTE_U directly
+// (see vmcopyin.c), so leave it execute-only: still
+// a leaf, so that nothing maps a page there, but one
+// that loads and stores fault on, since sstatus.MXR
+// is never set.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
@@ -334,7 +745,52 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  *pte = (*pte & ~(PTE_U|PTE_W|PTE_R)) | PTE_X;
+}
+
+// Look up the physical address of user page va0 for a
+// kernel copy. If the page is not mapped yet, or write
+// is set and the page is copy-on-write, let pagefault()
+// fix it up first. Returns 0 if the page cannot be had.
+// Otherwise returns with push_off() in effect, so that the
+// process keeps its CPU and the page can't be swapped out
+// before the caller is done with it and calls pop_off().
+static uint64
+uvmpage(pagetable_t pagetable, uint64 va0, int write)
+{
+  pte_t *pte;
+  uint64 pa, size;
+
+  if(va0 >= MAXVA)
+    return 0;
+  for(;;){
+    pte = walkleaf(pagetable, va0, &size);
+    if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW))){
+      if(pagefault(pagetable, va0, write ? PTE_W : PTE_R) < 0)
+        return 0;
+    }
+    push_off();
+    if((pa = walkaddr(pagetable, va0)) != 0)
+      return pa;
+    pop_off();
+    // swapped out again before push_off(), unless
+    // the page is mapped but not for the user.
+    pte = walkleaf(pagetable, va0, &size);
+    if(pte && (*pte & PTE_V))
+      return 0;
+  }
+}
+
+// Is pagetable the user page table of the process whose
+// kernel page table this CPU is running on? Then its user
+// memory can be reached directly.
+static int
+uvmlive(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  return p && p->pagetable == pagetable &&
+         SATP_PPN(r_satp()) == ((uint64)p->kpagetable >> 12);
 }
 
 // Copy from kernel to user.
@@ -345,15 +801,19 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmlive(pagetable))
+    return copyout_new(pagetable, dstva, src, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
     memmove((void *)(pa0 + (dstva - va0)), src, n);
+    pop_off();
 
     len -= n;
     src += n;
@@ -370,15 +830,19 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(uvmlive(pagetable))
+    return copyin_new(pagetable, dst, srcva, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
     memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    pop_off();
 
     len -= n;
     dst += n;
@@ -397,9 +861,12 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  if(uvmlive(pagetable))
+    return copyinstr_new(pagetable, dst, srcva, max);
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -420,6 +887,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
       p++;
       dst++;
     }
+    pop_off();
 
     srcva = va0 + PGSIZE;
   }
@@ -430,57 +898,153 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   }
 }
 
+// Given a parent process's page table, share its
+// memory in [start, end) with a child's page table,
+// copy-on-write if cow is set (not for MAP_SHARED):
+// writable pages become read-only with PTE_COW set
+// in both page tables, and each shared physical page
+// gets another reference, as does each swap slot. Pages
+// that are not mapped, such as heap pages never touched,
+// are skipped.
+// returns 0 on success, -1 on failure.
+// frees any page-table pages and drops any references
+// taken on failure.
+int
+mmapcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
+{
+  pte_t *pte, *npte;
+  uint64 pa, i, size;
+  uint flags;
+
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walkleaf(old, i, &size)) == 0)
+      continue;
+    if((*pte & PTE_V) == 0){
+      // the child shares the swapped-out copy.
+      if(*pte & PTE_SWAP){
+        if((npte = walk(new, i, 1)) == 0)
+          goto err;
+        *npte = *pte;
+        swapdup(PTE2SWAP(*pte));
+      }
+      continue;
+    }
+
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+    pa = PTE2PA(*pte);
+    flags = PTE_FLAGS(*pte);
+    if(size == MEGAPGSIZE){
+      // share the whole megapage.
+      if((npte = walkmega(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      for(int j = 0; j < 512; j++)
+        kref((void*)(pa + j*PGSIZE));
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
+      goto err;
+    kref((void*)pa);
+  }
+  return 0;
+
+ err:
+  mmapunmap(new, start, (i - start) / PGSIZE, 1);
+  return -1;
+}
+
+// Allocate the page-table pages that map va, if pagetable
+// lacks them, so that a page can then be mapped there with no
+// allocation. If memory is exhausted, make room the way
+// kalloc_user() does, so this may sleep. Returns 0 on
+// success, -1 if out of memory.
+int
+uvmwalk(pagetable_t pagetable, uint64 va)
+{
+  char *mem;
+
+  while(walk(pagetable, va, 1) == 0){
+    if((mem = kalloc_user(0, 1)) == 0)
+      return -1;
+    kfree(mem);
+  }
+  return 0;
+}
+
+// Map the zero page at va, for a read of anonymous memory
+// that has not been written yet. If perm allows writing, the
+// mapping is copy-on-write, so that the first write gets the
+// process a page of its own. Returns 0 on success, -1 if a
+// page-table page could not be allocated.
+int
+zeromap(pagetable_t pagetable, uint64 va, int perm)
+{
+  if(perm & PTE_W)
+    perm = (perm & ~PTE_W) | PTE_COW;
+  kref(zeropage);
+  if(mappages(pagetable, va, PGSIZE, (uint64)zeropage, perm) != 0){
+    kfree(zeropage);
+    return -1;
+  }
+  return 0;
+}
+
+// Give the process its own copy of the copy-on-write
+// page at va, so that it can be written. If no other
+// page table shares the page any more, just make it
+// writable again. Returns 0 on success, -1 if va is
+// not a copy-on-write page or memory is exhausted.
 int
- mmapcopy(pagetable_t old, pagetable_t new, uint64 sz)
- {
-   pte_t *pte;
-   uint64 pa, i;
-   uint flags;
-   char *mem;
-   for(i = 0; i < sz; i += PGSIZE){
-     if((pte = walk(old, i, 0)) == 0)
-       panic("uvmcopy: pte should exist");
-     if((*pte & PTE_V) == 0)
-       continue;
-     
-     pa = PTE2PA(*pte);
-     flags = PTE_FLAGS(*pte);
-     if((mem = kalloc()) == 0)
-       goto err;
-     memmove(mem, (char*)pa, PGSIZE);
-     if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-       kfree(mem);
-       goto err;
-     }
-   }
-   return 0;
-  err:
-   mmapunmap(new, 0, i / PGSIZE, 1);
-   return -1;
- }
-
-
- void
- mmapunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
- {
-   uint64 a;
-   pte_t *pte;
-   if((va % PGSIZE) != 0)
-     panic("uvmunmap: not aligned");
-   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-     if((pte = walk(pagetable, a, 0)) == 0)
-       panic("uvmunmap: walk");
-     // 本来就没有对应的物理页，跳过即可
-     if((*pte & PTE_V) == 0)
-       continue;
-     if(PTE_FLAGS(*pte) == PTE_V)
-       panic("uvmunmap: not a leaf");
-     if(do_free){
-       uint64 pa = PTE2PA(*pte);
-       kfree((void*)pa);
-     }
-     *pte = 0;
-   }
- }
+cowfault(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa, size;
+  char *mem;
+  int i;
+
+  if(va >= MAXVA)
+    return -1;
+
+  // a megapage no one else maps any more stays whole;
+  // otherwise it is split and only one page is copied.
+  pte = walkleaf(pagetable, va, &size);
+  if(pte && size == MEGAPGSIZE && (*pte & PTE_COW)){
+    pa = PTE2PA(*pte);
+    for(i = 0; i < 512; i++)
+      if(krefcnt((void*)(pa + i*PGSIZE)) != 1)
+        break;
+    if(i == 512){
+      *pte = (*pte & ~PTE_COW) | PTE_W;
+      return 0;
+    }
+  }
+
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
 
+  if(krefcnt((void*)pa) == 1){
+    // the page cache may have let go of the page.
+    if(kgetclass((void*)pa) == PG_FILE)
+      ksetclass((void*)pa, PG_USER);
+    *pte = (*pte & ~PTE_COW) | PTE_W;
+    return 0;
+  }
 
+  // hold on to the page while allocating, which may sleep;
+  // a page with more than one reference is never swapped.
+  kref((void*)pa);
+  if((mem = kalloc_user(pa == (uint64)zeropage, 1)) == 0){
+    kfree((void*)pa);
+    return -1;
+  }
+  if(pa != (uint64)zeropage)
+    memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | ((PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W);
+  kfree((void*)pa);
+  kfree((void*)pa);
+  return 0;
+}
@@ -0,0 +1,682 @@
+// Virtual memory areas: the regions of a process's address
+// space that are backed by something other than anonymous
+// memory, that is mmap()ed files and the program's segments
+// that exec() leaves to be paged in.
+//
+// A process keeps its VMAs in an AVL tree ordered by address,
+// p->vmas, so that pagefault() finds the one holding a faulting
+// address in O(log n) however many there are. It also remembers
+// the last one found, p->lastvma, since faults come in runs.
+// VMAs never overlap, so they are ordered by end address as
+// well as by start. Only the process itself uses its VMAs, so
+// they need no lock.
+//
+// A MAP_ANONYMOUS region has no file: its pages start out
+// zero. A MAP_PRIVATE one maps the zero page until written,
+// and fork() shares it copy-on-write like the heap. The
+// pages of a MAP_SHARED one live in a struct shm, which the
+// copies fork() makes of the region share, so that pages
+// either process touches later are shared too.
+//
+// mmap() places regions top-down from UMMAPTOP, far above the
+// heap, which sbrk() grows upwards, unless given an address
+// for one; below UMAXVA only once the range there is full. munmap() may unmap any part of any
+// regions, trimming them or splitting one in two.
+//
+// A MAP_SHARED region's changes go back to its file when it is
+// unmapped, when the process exits or execs, and on msync():
+// only pages whose PTE_D bit the MMU has set, and each at its
+// own offset in the file.
+//
+// madvise() sets a region's advice, which says how pagefault()
+// should read ahead in it (see vmafault()), splitting off the
+// parts of the region outside the advised range.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "memstat.h"
+
+// The pages of a shared anonymous region.
+struct shm {
+  int ref;          // VMAs that map it
+  uint npages;
+  char **pages;     // each page, or 0 if not yet touched
+};
+
+struct kcache *vmacache;
+struct spinlock shmlock;  // guards each shm's ref and pages
+
+void
+vmainit(void)
+{
+  vmacache = kcache_create("vma", sizeof(struct vma), PG_KERNEL);
+  initlock(&shmlock, "shm");
+}
+
+// Allocate shared anonymous memory of npages pages,
+// all zero. Returns 0 if out of memory.
+struct shm*
+shmalloc(uint npages)
+{
+  struct shm *s;
+
+  if((s = kmalloc(sizeof(*s))) == 0)
+    return 0;
+  if((s->pages = kmalloc(npages * sizeof(char*))) == 0){
+    kmfree(s);
+    return 0;
+  }
+  s->ref = 1;
+  s->npages = npages;
+  return s;
+}
+
+// Drop a reference to s, freeing it and its pages
+// with the last one.
+static void
+shmput(struct shm *s)
+{
+  int ref;
+
+  acquire(&shmlock);
+  ref = --s->ref;
+  release(&shmlock);
+  if(ref > 0)
+    return;
+  for(uint i = 0; i < s->npages; i++)
+    if(s->pages[i])
+      kfree(s->pages[i]);
+  kmfree(s->pages);
+  kmfree(s);
+}
+
+// Return page i of s, zeroed when first touched, with a
+// reference for the caller. Returns 0 if out of memory.
+char*
+shmpage(struct shm *s, uint i)
+{
+  char *mem, *new;
+
+  if(i >= s->npages)
+    panic("shmpage");
+  acquire(&shmlock);
+  mem = s->pages[i];
+  release(&shmlock);
+  if(mem == 0){
+    // allocating may sleep, so not under the lock; another
+    // process sharing s may fill the slot meanwhile.
+    if((new = kalloc_user(1, 1)) == 0)
+      return 0;
+    ksetclass(new, PG_MMAP);
+    acquire(&shmlock);
+    if(s->pages[i] == 0){
+      s->pages[i] = new;
+      new = 0;
+    }
+    mem = s->pages[i];
+    release(&shmlock);
+    if(new)
+      kfree(new);
+  }
+  kref(mem);
+  return mem;
+}
+
+// Allocate a zeroed VMA. Returns 0 if out of memory.
+struct vma*
+vmaalloc(void)
+{
+  return kcache_alloc(vmacache);
+}
+
+// Does VMA v write to its file's pages?
+static int
+wmap(struct vma *v)
+{
+  return v->file && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE);
+}
+
+// Take another reference to what VMA v maps: its file,
+// the executable for a program segment, or its shm. Neither
+// count can be refused: v already holds one.
+void
+vmadup(struct vma *v)
+{
+  if(v->file)
+    filedup(v->file);
+  if(wmap(v))
+    iwmapdup(v->file->ip);
+  if(v->ip)
+    itextdup(v->ip);
+  if(v->shm){
+    acquire(&shmlock);
+    v->shm->ref++;
+    release(&shmlock);
+  }
+}
+
+// Drop VMA v's reference to what it maps, and free it.
+// The caller has taken it out of its tree, and unmaps
+// its pages.
+void
+vmaclose(struct vma *v)
+{
+  if(wmap(v))
+    iwmapput(v->file->ip);
+  if(v->file)
+    fileclose(v->file);
+  if(v->ip){
+    begin_op();
+    itextput(v->ip);
+    end_op();
+  }
+  if(v->shm)
+    shmput(v->shm);
+  kcache_free(vmacache, v);
+}
+
+static int
+height(struct vma *v)
+{
+  return v ? v->height : 0;
+}
+
+static void
+fixheight(struct vma *v)
+{
+  int l = height(v->left), r = height(v->right);
+
+  v->height = (l > r ? l : r) + 1;
+}
+
+static struct vma*
+rotateright(struct vma *v)
+{
+  struct vma *l = v->left;
+
+  v->left = l->right;
+  l->right = v;
+  fixheight(v);
+  fixheight(l);
+  return l;
+}
+
+static struct vma*
+rotateleft(struct vma *v)
+{
+  struct vma *r = v->right;
+
+  v->right = r->left;
+  r->left = v;
+  fixheight(v);
+  fixheight(r);
+  return r;
+}
+
+// Restore the AVL balance at v, whose subtrees are balanced
+// and differ in height by at most 2. Returns the new root.
+static struct vma*
+balance(struct vma *v)
+{
+  fixheight(v);
+  if(height(v->left) > height(v->right) + 1){
+    if(height(v->left->right) > height(v->left->left))
+      v->left = rotateleft(v->left);
+    return rotateright(v);
+  }
+  if(height(v->right) > height(v->left) + 1){
+    if(height(v->right->left) > height(v->right->right))
+      v->right = rotateright(v->right);
+    return rotateleft(v);
+  }
+  return v;
+}
+
+static struct vma*
+insert(struct vma *t, struct vma *v)
+{
+  if(t == 0){
+    v->left = v->right = 0;
+    v->height = 1;
+    return v;
+  }
+  if(v->st < t->st)
+    t->left = insert(t->left, v);
+  else
+    t->right = insert(t->right, v);
+  return balance(t);
+}
+
+// Take the lowest VMA out of t, into *min.
+// Returns the new root.
+static struct vma*
+removemin(struct vma *t, struct vma **min)
+{
+  if(t->left == 0){
+    *min = t;
+    return t->right;
+  }
+  t->left = removemin(t->left, min);
+  return balance(t);
+}
+
+static struct vma*
+remove(struct vma *t, struct vma *v)
+{
+  struct vma *min;
+
+  if(t == 0)
+    panic("vmaremove");
+  if(v->st < t->st){
+    t->left = remove(t->left, v);
+  } else if(v->st > t->st){
+    t->right = remove(t->right, v);
+  } else {
+    if(t->right == 0)
+      return t->left;
+    t->right = removemin(t->right, &min);
+    min->left = t->left;
+    min->right = t->right;
+    t = min;
+  }
+  return balance(t);
+}
+
+// Add v to p's VMAs. It must not overlap any of them.
+void
+vmainsert(struct proc *p, struct vma *v)
+{
+  p->vmas = insert(p->vmas, v);
+}
+
+// Take v out of p's VMAs.
+void
+vmaremove(struct proc *p, struct vma *v)
+{
+  p->vmas = remove(p->vmas, v);
+  if(p->lastvma == v)
+    p->lastvma = 0;
+}
+
+// Return the lowest of p's VMAs that ends above va,
+// or 0 if there is none.
+struct vma*
+vmaafter(struct proc *p, uint64 va)
+{
+  struct vma *t, *v = 0;
+
+  for(t = p->vmas; t; ){
+    if(t->ed > va){
+      v = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return v;
+}
+
+// Return p's VMA that holds va, or 0 if none does.
+struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v = p->lastvma;
+
+  if(v && v->st <= va && va < v->ed)
+    return v;
+  if((v = vmaafter(p, va)) == 0 || va < v->st)
+    return 0;
+  p->lastvma = v;
+  return v;
+}
+
+// Return the lowest of p's VMAs that overlaps [st, ed),
+// or 0 if none does.
+struct vma*
+vmaoverlap(struct proc *p, uint64 st, uint64 ed)
+{
+  struct vma *v;
+
+  if((v = vmaafter(p, st)) == 0 || v->st >= ed)
+    return 0;
+  return v;
+}
+
+// The highest len bytes of addresses in [bottom, top) that
+// no VMA uses, or 0 if there are none.
+static uint64
+place(struct proc *p, uint64 bottom, uint64 top, uint64 len)
+{
+  struct vma *v;
+
+  for(;;){
+    if(top < bottom || top - bottom < len)
+      return 0;
+    if((v = vmaoverlap(p, top - len, top)) == 0)
+      return top - len;
+    top = v->st;
+  }
+}
+
+// Find len bytes of free addresses for an mmap() region:
+// the highest ones below UMMAPTOP, or failing that the
+// highest below UMAXVA that are above the heap.
+// Returns the start, or 0 if there is no room.
+uint64
+vmaplace(struct proc *p, uint64 len)
+{
+  uint64 va;
+
+  if((va = place(p, UMMAPBASE, UMMAPTOP, len)) != 0)
+    return va;
+  return place(p, PGROUNDUP(p->sz), UMAXVA, len);
+}
+
+// Split p's VMA v in two at a, a page boundary strictly
+// inside it: v keeps [v->st, a), and a new VMA takes
+// [a, v->ed), with the file offset and file-backed part
+// that make its pages fault in the same data. Returns -1,
+// leaving v whole, if out of memory.
+int
+vmasplit(struct proc *p, struct vma *v, uint64 a)
+{
+  struct vma *nv;
+
+  if((nv = vmaalloc()) == 0)
+    return -1;
+  *nv = *v;
+  nv->st = a;
+  nv->offset += a - v->st;
+  nv->filesz = v->filesz > a - v->st ? v->filesz - (a - v->st) : 0;
+  nv->length = nv->ed - nv->st;
+  vmadup(nv);
+  v->ed = a;
+  if(v->filesz > a - v->st)
+    v->filesz = a - v->st;
+  v->length = v->ed - v->st;
+  vmainsert(p, nv);
+  return 0;
+}
+
+// Unmap [st, ed) of p's memory, which is page-aligned: write
+// back the shared pages of the VMAs there, unmap their pages,
+// and trim them to what is left, splitting one in two if the
+// range falls in its middle. Addresses no VMA covers are
+// skipped. Returns 0 on success, -1 if out of memory, in
+// which case the VMAs before the one that failed have been
+// unmapped, and the rest still map what they did.
+int
+vmaunmap(struct proc *p, uint64 st, uint64 ed)
+{
+  struct vma *v, *next;
+  uint64 a, b;
+
+  if((v = vmaoverlap(p, st, ed)) == 0)
+    return 0;
+  // if the range lies inside v, the part after it becomes
+  // a VMA of its own, which may fail.
+  if(v->st < st && ed < v->ed && vmasplit(p, v, ed) < 0)
+    return -1;
+
+  for(; v && v->st < ed; v = next){
+    next = vmaafter(p, v->ed);
+    a = v->st > st ? v->st : st;
+    b = v->ed < ed ? v->ed : ed;
+    vmasync(p, v, a, b);
+    if(mmapunmap(p->pagetable, a, (b - a) / PGSIZE, 1) < 0)
+      return -1;
+    if(a == v->st && b == v->ed){
+      vmaremove(p, v);
+      vmaclose(v);
+      continue;
+    }
+    // st stays within the region, so the tree's order
+    // holds; the file offset and the file-backed part move
+    // with it, so that the pages left fault in the same data.
+    if(a == v->st){
+      v->st = b;
+      v->offset += b - a;
+      v->filesz = v->filesz > b - a ? v->filesz - (b - a) : 0;
+    } else {
+      v->ed = a;
+      if(v->filesz > a - v->st)
+        v->filesz = a - v->st;
+    }
+    v->length = v->ed - v->st;
+  }
+  return 0;
+}
+
+// Free the VMAs of tree t, without dropping references.
+static void
+freetree(struct vma *t)
+{
+  if(t == 0)
+    return;
+  freetree(t->left);
+  freetree(t->right);
+  kcache_free(vmacache, t);
+}
+
+// Copy tree t, without taking references.
+// Returns 0, having copied nothing, if out of memory.
+static struct vma*
+clone(struct vma *t)
+{
+  struct vma *v;
+
+  if(t == 0)
+    return 0;
+  if((v = vmaalloc()) == 0)
+    return 0;
+  *v = *t;
+  v->left = v->right = 0;
+  if((t->left && (v->left = clone(t->left)) == 0) ||
+     (t->right && (v->right = clone(t->right)) == 0)){
+    if(v->left)
+      freetree(v->left);
+    kcache_free(vmacache, v);
+    return 0;
+  }
+  return v;
+}
+
+// Unmap from pagetable the pages of p's VMAs that lie above
+// va and start below end.
+static void
+unmapabove(pagetable_t pagetable, struct proc *p, uint64 va, uint64 end)
+{
+  struct vma *v;
+  uint64 st;
+
+  for(v = vmaafter(p, va); v && v->st < end; v = vmaafter(p, v->ed)){
+    st = v->st > va ? v->st : va;
+    mmapunmap(pagetable, st, (v->ed - st) / PGSIZE, 1);
+  }
+}
+
+// For fork(): give np copies of p's VMAs, and share with it
+// the pages of them that lie above p->sz, which fork() does
+// not copy itself: MAP_SHARED pages as they are, the rest
+// copy-on-write. Returns 0 on success, -1 on failure, in
+// which case nothing has been copied.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  uint64 sz = PGROUNDUP(p->sz), st;
+  struct vma *v;
+
+  for(v = vmaafter(p, sz); v; v = vmaafter(p, v->ed)){
+    st = v->st > sz ? v->st : sz;
+    if(mmapcopy(p->pagetable, np->pagetable, st, v->ed, !(v->flags & MAP_SHARED)) < 0){
+      unmapabove(np->pagetable, p, sz, st);
+      return -1;
+    }
+  }
+  if(p->vmas && (np->vmas = clone(p->vmas)) == 0){
+    unmapabove(np->pagetable, p, sz, UMMAPTOP);
+    return -1;
+  }
+  for(v = vmaafter(np, 0); v; v = vmaafter(np, v->ed))
+    vmadup(v);
+  return 0;
+}
+
+// Write n bytes at pa to ip at offset off, a few blocks per
+// transaction, as filewrite() does. Bytes past the end of
+// the file are not written; a mapping doesn't extend it.
+static void
+writeback(struct inode *ip, char *pa, uint off, uint n)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint i, n1;
+
+  for(i = 0; i < n; i += n1){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    begin_op();
+    ilock(ip);
+    if(off + i >= ip->size){
+      iunlock(ip);
+      end_op();
+      break;
+    }
+    if(n1 > ip->size - (off + i))
+      n1 = ip->size - (off + i);
+    writei(ip, 0, (uint64)pa + i, off + i, n1);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Write the pages of p's VMA v in [st, ed) that have been
+// written since they were mapped or last written back, if
+// v is MAP_SHARED, to v's file.
+void
+vmasync(struct proc *p, struct vma *v, uint64 st, uint64 ed)
+{
+  uint64 a, size, n;
+  pte_t *pte;
+
+  if(!(v->flags & MAP_SHARED) || v->file == 0)
+    return;
+  if(st < v->st)
+    st = v->st;
+  if(ed > v->ed)
+    ed = v->ed;
+  for(a = PGROUNDDOWN(st); a < ed && a - v->st < v->filesz; a += PGSIZE){
+    pte = walkleaf(p->pagetable, a, &size);
+    if(pte == 0 || (*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+      continue;
+    // clean it first, so that the MMU sets PTE_D again
+    // if the page is written while it is being written back.
+    *pte &= ~PTE_D;
+    proctlbflush(p->pagetable, &a, 1);
+    n = v->filesz - (a - v->st);
+    if(n > PGSIZE)
+      n = PGSIZE;
+    writeback(v->file->ip, (char*)PTE2PA(*pte), v->offset + (a - v->st), n);
+  }
+}
+
+// Fault in the pages of [va, va+n) of p that lie in VMAs
+// backed by a file, for an access that needs the PTE bit
+// access. read() and write() do this before they lock the
+// file's inode, so that their copies to and from user memory
+// need not lock another inode (see vmafault()). Pages that
+// can't be faulted in are left for the copy to fail on.
+void
+vmaprefault(struct proc *p, uint64 va, uint64 n, int access)
+{
+  struct vma *v;
+  uint64 a, ed;
+  pte_t *pte;
+  uint64 size;
+
+  if(va + n < va)
+    return;
+  for(v = vmaoverlap(p, va, va + n); v && v->st < va + n; v = vmaafter(p, v->ed)){
+    if(v->file == 0 && v->ip == 0)
+      continue;
+    a = PGROUNDDOWN(va) > v->st ? PGROUNDDOWN(va) : v->st;
+    ed = va + n < v->ed ? va + n : v->ed;
+    for(; a < ed; a += PGSIZE){
+      pte = walkleaf(p->pagetable, a, &size);
+      if(pte && (*pte & (PTE_V|PTE_U|access)) == (PTE_V|PTE_U|access))
+        continue;
+      if(pagefault(p->pagetable, a, access) < 0)
+        break;
+    }
+  }
+}
+
+// Drop p's pages of VMA v in [st, ed), writing back shared
+// ones first. They are faulted in again, from the file or as
+// zeros, if they are used.
+void
+vmadrop(struct proc *p, struct vma *v, uint64 st, uint64 ed)
+{
+  if(st < v->st)
+    st = v->st;
+  if(ed > v->ed)
+    ed = v->ed;
+  st = PGROUNDDOWN(st);
+  ed = PGROUNDUP(ed);
+  if(st >= ed)
+    return;
+  vmasync(p, v, st, ed);
+  mmapunmap(p->pagetable, st, (ed - st) / PGSIZE, 1);
+}
+
+// Read the file pages of VMA v in [st, ed) into the page
+// cache, so that faults on them need no I/O.
+void
+vmaprefetch(struct vma *v, uint64 st, uint64 ed)
+{
+  struct inode *ip = v->file ? v->file->ip : v->ip;
+  uint64 off;
+  char *mem;
+
+  if(ip == 0)
+    return;
+  if(st < v->st)
+    st = v->st;
+  if(ed > v->st + v->filesz)
+    ed = v->st + v->filesz;
+  if(st >= ed)
+    return;
+  // the file pages holding the region's bytes [st, ed).
+  ilock(ip);
+  for(off = PGROUNDDOWN(v->offset + (st - v->st));
+      off < v->offset + (ed - v->st); off += PGSIZE){
+    if((mem = pcacheget(ip, off, PC_AHEAD)) == 0)
+      break;
+    kfree(mem);
+  }
+  iunlock(ip);
+}
+
+// Remove all of p's VMAs, writing back shared pages and
+// unmapping them from pagetable, for exit() and exec().
+void
+vmafree(struct proc *p, pagetable_t pagetable)
+{
+  struct vma *v;
+
+  while((v = p->vmas) != 0){
+    vmasync(p, v, v->st, v->ed);
+    vmaremove(p, v);
+    mmapunmap(pagetable, v->st, (v->ed - v->st) / PGSIZE, 1);
+    vmaclose(v);
+  }
+}
@@ -0,0 +1,103 @@
+// Copies between the kernel and the current process's user
+// memory that reach the user pages directly, through the page
+// table the CPU is running on: the process's kernel page table,
+// which maps its user memory too (see kvmcreate()). The copy
+// loops are in ucopy.S; a fault in one of them makes it return
+// -1, and the page is fixed with pagefault() before the copy
+// is tried again. copyout(), copyin() and copyinstr() in vm.c
+// use these when pagetable is the one in use.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in the
+// current page table, a page at a time.
+// Return 0 on success, -1 on error.
+int
+copyout_new(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  uint64 n, va0;
+
+  if(!uvmrange(dstva, len))
+    return -1;
+  while(len > 0){
+    va0 = PGROUNDDOWN(dstva);
+    n = PGSIZE - (dstva - va0);
+    if(n > len)
+      n = len;
+    if(ucopy((void *)dstva, src, n) < 0){
+      if(pagefault(pagetable, va0, PTE_W) < 0)
+        return -1;
+      continue;
+    }
+    len -= n;
+    src += n;
+    dstva += n;
+  }
+  return 0;
+}
+
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in the
+// current page table, a page at a time.
+// Return 0 on success, -1 on error.
+int
+copyin_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  uint64 n, va0;
+
+  if(!uvmrange(srcva, len))
+    return -1;
+  while(len > 0){
+    va0 = PGROUNDDOWN(srcva);
+    n = PGSIZE - (srcva - va0);
+    if(n > len)
+      n = len;
+    if(ucopy(dst, (void *)srcva, n) < 0){
+      if(pagefault(pagetable, va0, PTE_R) < 0)
+        return -1;
+      continue;
+    }
+    len -= n;
+    dst += n;
+    srcva += n;
+  }
+  return 0;
+}
+
+// Copy a null-terminated string from user to kernel.
+// Copy bytes to dst from virtual address srcva in the
+// current page table, until a '\0', or max.
+// Return 0 on success, -1 on error.
+int
+copyinstr_new(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+  uint64 n, va0;
+  int r;
+
+  while(max > 0){
+    if(!uvmrange(srcva, 1))
+      return -1;
+    va0 = PGROUNDDOWN(srcva);
+    n = PGSIZE - (srcva - va0);
+    if(n > max)
+      n = max;
+    if((r = ucopystr(dst, (char *)srcva, n)) < 0){
+      if(pagefault(pagetable, va0, PTE_R) < 0)
+        return -1;
+      continue;
+    }
+    if(r == 1)
+      return 0;
+    max -= n;
+    dst += n;
+    srcva += n;
+  }
+  return -1;
+}
@@ -108,7 +108,8 @@ main(int argc, char *argv[])
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
+  // the swap area follows the file system, 4 blocks a page.
+  for(i = 0; i < SWAPSTART + NSWAP*(4096/BSIZE); i++)
     wsect(i, zeroes);
 
   memset(buf, 0, sizeof(buf));
@@ -0,0 +1,210 @@
+// Micro-benchmarks for the memory system.
+// usage: bench test [iterations]
+// Times are measured with uptime(), in clock ticks
+// (about 1/10th of a second in qemu), so use enough
+// iterations for the total to span many ticks.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+// report n iterations that took t ticks.
+void
+report(char *name, int n, int t)
+{
+  printf("%s: %d iterations in %d ticks, %d us/iteration\n",
+         name, n, t, t * 100000 / n);
+}
+
+// fork() and exec() a trivial program from a process
+// with a 4 MB heap, as a shell running a command does.
+void
+forkexec(int n)
+{
+  char *argv[] = { "bench", "nop", 0 };
+  char *heap;
+  int i, t0, pid;
+
+  if((heap = sbrk(4*1024*1024)) == (char*)-1){
+    printf("bench: sbrk failed\n");
+    exit(1);
+  }
+  for(i = 0; i < 4*1024*1024; i += PGSIZE)
+    heap[i] = i;
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      printf("bench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[0], argv);
+      printf("bench: exec failed\n");
+      exit(1);
+    }
+    wait(0);
+  }
+  report("forkexec", n, uptime() - t0);
+}
+
+// fork() and exec() a large program, usertests, with an
+// argument that makes it exit at once, so the time is
+// exec()'s setting up of its address space, which grows
+// with the size of the binary unless exec() pages it in.
+void
+bigexec(int n)
+{
+  char *argv[] = { "usertests", "-x", 0 };
+  struct stat st;
+  int i, t0, pid;
+
+  if(stat(argv[0], &st) < 0){
+    printf("bench: cannot stat %s\n", argv[0]);
+    exit(1);
+  }
+  printf("%s: %d bytes\n", argv[0], (int)st.size);
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0){
+      printf("bench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(1);   // its usage message
+      exec(argv[0], argv);
+      exit(1);
+    }
+    wait(0);
+  }
+  report("bigexec", n, uptime() - t0);
+}
+
+// getpid() round trips, touching a few pages between them,
+// as a program does; a TLB flush on each trap makes every
+// one of those touches miss.
+void
+syscall(int n)
+{
+  static char buf[16*PGSIZE];
+  int i, j, t0;
+
+  n *= 1000;
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    getpid();
+    for(j = 0; j < sizeof(buf); j += PGSIZE)
+      buf[j]++;
+  }
+  report("syscall", n, uptime() - t0);
+}
+
+// grow the heap by 16 MB, touch one page in eight, and
+// shrink it again, to time the unmapping of a sparse heap.
+void
+shrink(int n)
+{
+  enum { SZ=16*1024*1024 };
+  char *a;
+  int i, j, t0;
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if((a = sbrk(SZ)) == (char*)-1){
+      printf("bench: sbrk failed\n");
+      exit(1);
+    }
+    for(j = 0; j < SZ; j += 8*PGSIZE)
+      a[j] = j;
+    sbrk(-SZ);
+  }
+  report("shrink", n, uptime() - t0);
+}
+
+// read() a cached file, and write() to a pipe that a child
+// drains, with buffers of increasing size. Small buffers
+// show the cost of each system call's copy; large ones the
+// copy's throughput.
+void
+rw(int n)
+{
+  enum { FSZ=64*1024 };
+  static char buf[FSZ];
+  int fd, fds[2], size, i, k, t0, pid;
+
+  if((fd = open("bench.tmp", O_CREATE|O_RDWR)) < 0 ||
+     write(fd, buf, FSZ) != FSZ){
+    printf("bench: cannot create bench.tmp\n");
+    exit(1);
+  }
+  close(fd);
+  for(size = 64; size <= FSZ; size *= 4){
+    t0 = uptime();
+    for(i = 0; i < n; i++){
+      if((fd = open("bench.tmp", O_RDONLY)) < 0)
+        exit(1);
+      for(k = 0; k < FSZ; k += size)
+        read(fd, buf, size);
+      close(fd);
+    }
+    printf("read %d-byte buffers: %d KB in %d ticks\n",
+           size, n * (FSZ/1024), uptime() - t0);
+  }
+  unlink("bench.tmp");
+
+  for(size = 64; size <= FSZ; size *= 4){
+    if(pipe(fds) < 0 || (pid = fork()) < 0){
+      printf("bench: pipe or fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[1]);
+      while(read(fds[0], buf, FSZ) > 0)
+        ;
+      exit(0);
+    }
+    close(fds[0]);
+    t0 = uptime();
+    for(i = 0; i < n; i++)
+      for(k = 0; k < FSZ; k += size)
+        write(fds[1], buf, size);
+    close(fds[1]);
+    wait(0);
+    printf("write %d-byte buffers: %d KB in %d ticks\n",
+           size, n * (FSZ/1024), uptime() - t0);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  if(argc < 2){
+    printf("usage: bench forkexec|bigexec|syscall|shrink|rw [n]\n");
+    exit(1);
+  }
+  n = argc > 2 ? atoi(argv[2]) : 200;
+  if(n <= 0)
+    n = 1;
+
+  if(strcmp(argv[1], "nop") == 0)
+    exit(0);
+  else if(strcmp(argv[1], "forkexec") == 0)
+    forkexec(n);
+  else if(strcmp(argv[1], "bigexec") == 0)
+    bigexec(n);
+  else if(strcmp(argv[1], "syscall") == 0)
+    syscall(n);
+  else if(strcmp(argv[1], "shrink") == 0)
+    shrink(n);
+  else if(strcmp(argv[1], "rw") == 0)
+    rw(n);
+  else {
+    printf("bench: unknown test %s\n", argv[1]);
+    exit(1);
+  }
+  exit(0);
+}
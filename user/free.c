@@ -0,0 +1,52 @@
+// free: show how physical memory is used, and the
+// size and resident set of each process.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/param.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+char *classes[NPGCLASS] = {
+[PG_FREE]    "free",
+[PG_KERNEL]  "kernel",
+[PG_PGTBL]   "pgtbl",
+[PG_USER]    "user",
+[PG_KSTACK]  "kstack",
+[PG_PIPE]    "pipe",
+[PG_MMAP]    "mmap",
+[PG_FILE]    "file",
+};
+
+struct procmem pm[NPROC];
+
+// Pages to kilobytes.
+int
+kb(uint64 pages)
+{
+  return pages * 4;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat ms;
+  int i, n;
+
+  if((n = memstat(&ms, pm, NPROC)) < 0){
+    fprintf(2, "free: memstat failed\n");
+    exit(1);
+  }
+
+  printf("total %d KB, used %d KB, free %d KB\n", kb(ms.total),
+         kb(ms.total - ms.pages[PG_FREE]), kb(ms.pages[PG_FREE]));
+  for(i = 0; i < NPGCLASS; i++)
+    printf("  %s\t%d KB\n", classes[i], kb(ms.pages[i]));
+  printf("swap %d KB, used %d KB\n", kb(ms.swaptotal), kb(ms.swapused));
+
+  printf("pid\tsize KB\trss KB\tname\n");
+  for(i = 0; i < n; i++)
+    printf("%d\t%d\t%d\t%s\n", pm[i].pid, (int)(pm[i].sz / 1024),
+           kb(pm[i].rss), pm[i].name);
+  exit(0);
+}
@@ -4,10 +4,20 @@
 #include "kernel/stat.h"
 #include "kernel/riscv.h"
 #include "kernel/fs.h"
+#include "kernel/memstat.h"
 #include "user/user.h"
 
 void mmap_test();
 void fork_test();
+void sparse_test();
+void many_test();
+void dirty_test();
+void coherent_test();
+void private_test();
+void madvise_test();
+void anon_test();
+void window_test();
+void cross_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -17,6 +27,15 @@ main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  sparse_test();
+  many_test();
+  dirty_test();
+  coherent_test();
+  private_test();
+  madvise_test();
+  anon_test();
+  window_test();
+  cross_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -295,3 +314,645 @@ fork_test(void)
   printf("fork_test OK\n");
 }
 
+//
+// map a big file, and touch one page of it: only that page,
+// and perhaps a few around it, should be read in. then check
+// that the rest reads correctly, page by page.
+//
+void
+sparse_test(void)
+{
+  enum { NPG=40 };
+  struct memstat before, after;
+  const char * const f = "mmap.sparse";
+  int fd, i, j;
+  char *p;
+
+  printf("sparse_test starting\n");
+  testname = "sparse_test";
+
+  unlink(f);
+  if((fd = open(f, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  for(i = 0; i < NPG; i++){
+    memset(buf, 'a' + i % 26, BSIZE);
+    for(j = 0; j < PGSIZE/BSIZE; j++)
+      if(write(fd, buf, BSIZE) != BSIZE)
+        err("write");
+  }
+
+  memstat(&before, 0, 0);
+  p = mmap(0, NPG*PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  if(p[(NPG/2)*PGSIZE + 7] != 'a' + (NPG/2) % 26)
+    err("middle page mismatch");
+  memstat(&after, 0, 0);
+  if(after.pages[PG_FILE] - before.pages[PG_FILE] > FAULTAROUND)
+    err("one fault read in too much of the file");
+
+  for(i = 0; i < NPG; i++)
+    if(p[i*PGSIZE] != 'a' + i % 26 || p[i*PGSIZE + PGSIZE-1] != 'a' + i % 26)
+      err("page mismatch");
+  munmap(p, NPG*PGSIZE);
+  unlink(f);
+
+  printf("sparse_test OK\n");
+}
+
+//
+// many mappings at once: more than the old fixed table held,
+// each its own region, all clear of a heap that grows under
+// them, and each still readable after the others go.
+//
+void
+many_test(void)
+{
+  enum { N=64 };
+  const char * const f = "mmap.many";
+  char *p[N], *brk;
+  int fd, i, j;
+
+  printf("many_test starting\n");
+  testname = "many_test";
+
+  unlink(f);
+  if((fd = open(f, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  memset(buf, 'm', BSIZE);
+  for(j = 0; j < PGSIZE/BSIZE; j++)
+    if(write(fd, buf, BSIZE) != BSIZE)
+      err("write");
+
+  for(i = 0; i < N; i++){
+    if((p[i] = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      err("mmap");
+    for(j = 0; j < i; j++)
+      if(p[i] == p[j])
+        err("two mappings at one address");
+  }
+  close(fd);
+
+  // the heap grows up to the mappings, but not into them.
+  brk = sbrk(0);
+  for(i = 0; i < N; i++)
+    if(p[i] < brk)
+      err("mapping below the heap");
+  if(sbrk(PGSIZE) == (char*)-1)
+    err("sbrk");
+  brk[0] = 'h';
+
+  for(i = 0; i < N; i += 2)
+    if(munmap(p[i], PGSIZE) == -1)
+      err("munmap");
+  for(i = 1; i < N; i += 2)
+    if(p[i][0] != 'm' || p[i][PGSIZE-1] != 'm')
+      err("content mismatch");
+  for(i = 1; i < N; i += 2)
+    if(munmap(p[i], PGSIZE) == -1)
+      err("munmap");
+  sbrk(-PGSIZE);
+  unlink(f);
+
+  printf("many_test OK\n");
+}
+
+// the byte at offset off of file f.
+char
+fbyte(const char *f, int off)
+{
+  int fd, n;
+
+  if((fd = open(f, O_RDONLY)) < 0)
+    err("open");
+  while((n = read(fd, buf, BSIZE)) > 0 && off >= n)
+    off -= n;
+  close(fd);
+  if(n <= 0)
+    err("read");
+  return buf[off];
+}
+
+//
+// MAP_SHARED changes go back to the file page by page, at
+// their own offsets, and only for pages that were written:
+// on msync(), munmap() and exit.
+//
+void
+dirty_test(void)
+{
+  enum { NPG=4 };
+  const char * const f = "mmap.dirty";
+  int fd, i, j, pid, xstatus;
+  char *p;
+
+  printf("dirty_test starting\n");
+  testname = "dirty_test";
+
+  unlink(f);
+  if((fd = open(f, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  memset(buf, '.', BSIZE);
+  for(i = 0; i < NPG; i++)
+    for(j = 0; j < PGSIZE/BSIZE; j++)
+      if(write(fd, buf, BSIZE) != BSIZE)
+        err("write");
+  close(fd);
+
+  if((fd = open(f, O_RDWR)) < 0)
+    err("open");
+  p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+
+  // page 0 is only read, so unmapping it must not undo a
+  // write() to the file since.
+  if(p[0] != '.')
+    err("page 0 mismatch");
+  if(write(fd, "w", 1) != 1)
+    err("write");
+
+  // msync() writes page 1 back, at its offset.
+  p[PGSIZE + 1] = '1';
+  if(msync(p + PGSIZE, PGSIZE) != 0)
+    err("msync");
+  if(fbyte(f, PGSIZE + 1) != '1')
+    err("msync didn't write page 1 back");
+
+  // munmap() writes page 2 back.
+  p[2*PGSIZE + 2] = '2';
+  if(munmap(p, 3*PGSIZE) != 0)
+    err("munmap");
+  if(fbyte(f, 0) != 'w')
+    err("clean page 0 written back");
+  if(fbyte(f, 2*PGSIZE + 2) != '2')
+    err("munmap didn't write page 2 back");
+
+  // exit writes page 3 back.
+  if((pid = fork()) < 0)
+    err("fork");
+  if(pid == 0){
+    p[3*PGSIZE + 3] = '3';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child");
+  if(fbyte(f, 3*PGSIZE + 3) != '3')
+    err("exit didn't write page 3 back");
+
+  munmap(p + 3*PGSIZE, PGSIZE);
+  close(fd);
+  unlink(f);
+
+  printf("dirty_test OK\n");
+}
+
+//
+// MAP_SHARED mappings of a file, read() and write() all use
+// the same pages: each sees the others' changes at once,
+// without msync() or munmap(), across fork() too.
+//
+void
+coherent_test(void)
+{
+  const char * const f = "mmap.coherent";
+  int fd, pid, xstatus;
+  char *p, *q;
+
+  printf("coherent_test starting\n");
+  testname = "coherent_test";
+
+  unlink(f);
+  if((fd = open(f, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  memset(buf, '.', BSIZE);
+  for(int i = 0; i < PGSIZE/BSIZE; i++)
+    if(write(fd, buf, BSIZE) != BSIZE)
+      err("write");
+
+  p = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED || q == MAP_FAILED)
+    err("mmap");
+  if(p == q)
+    err("same address");
+
+  // a store through one mapping shows in the other, and in read().
+  p[10] = 'p';
+  if(q[10] != 'p')
+    err("store not seen by other mapping");
+  if(fbyte(f, 10) != 'p')
+    err("store not seen by read");
+
+  // a write() shows in both mappings.
+  close(fd);
+  if((fd = open(f, O_RDWR)) < 0)
+    err("open");
+  if(read(fd, buf, 20) != 20 || write(fd, "w", 1) != 1)
+    err("write");
+  if(p[20] != 'w' || q[20] != 'w')
+    err("write not seen by mappings");
+
+  // a child's store shows in the parent, while both run.
+  if((pid = fork()) < 0)
+    err("fork");
+  if(pid == 0){
+    q[30] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child");
+  if(p[30] != 'c')
+    err("child's store not seen");
+
+  munmap(p, PGSIZE);
+  munmap(q, PGSIZE);
+  close(fd);
+  unlink(f);
+
+  printf("coherent_test OK\n");
+}
+
+//
+// MAP_PRIVATE mappings of a file share its cached pages until
+// they are written; a write copies just that page, and goes
+// to neither the file nor other mappings.
+//
+void
+private_test(void)
+{
+  enum { NPG=8 };
+  struct memstat before, after;
+  const char * const f = "mmap.private";
+  int fd, i, j, pid, xstatus;
+  char *p, *q;
+
+  printf("private_test starting\n");
+  testname = "private_test";
+
+  unlink(f);
+  if((fd = open(f, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  memset(buf, '.', BSIZE);
+  for(i = 0; i < NPG; i++)
+    for(j = 0; j < PGSIZE/BSIZE; j++)
+      if(write(fd, buf, BSIZE) != BSIZE)
+        err("write");
+
+  p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  q = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED || q == MAP_FAILED)
+    err("mmap");
+  close(fd);
+
+  // reading both mappings reads each page into memory once.
+  memstat(&before, 0, 0);
+  for(i = 0; i < NPG; i++)
+    if(p[i*PGSIZE] != '.' || q[i*PGSIZE] != '.')
+      err("page mismatch");
+  memstat(&after, 0, 0);
+  if(after.pages[PG_FILE] - before.pages[PG_FILE] > NPG)
+    err("mappings don't share pages");
+  if(after.pages[PG_USER] - before.pages[PG_USER] >= NPG)
+    err("read made private copies");
+
+  // a write copies the page, privately.
+  p[PGSIZE + 1] = 'p';
+  if(q[PGSIZE + 1] != '.')
+    err("write seen by other mapping");
+  if(fbyte(f, PGSIZE + 1) != '.')
+    err("write reached the file");
+
+  // and so does a write in a forked child.
+  if((pid = fork()) < 0)
+    err("fork");
+  if(pid == 0){
+    q[2*PGSIZE] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child");
+  if(q[2*PGSIZE] != '.' || p[PGSIZE + 1] != 'p')
+    err("child's write seen by parent");
+
+  munmap(p, NPG*PGSIZE);
+  munmap(q, NPG*PGSIZE);
+  if(fbyte(f, PGSIZE + 1) != '.')
+    err("munmap wrote a private page back");
+  unlink(f);
+
+  printf("private_test OK\n");
+}
+
+// this process's resident set size, in pages.
+int
+myrss(void)
+{
+  static struct procmem pm[NPROC];
+  struct memstat ms;
+  int i, n, pid = getpid();
+
+  n = memstat(&ms, pm, NPROC);
+  for(i = 0; i < n; i++)
+    if(pm[i].pid == pid)
+      return pm[i].rss;
+  err("no rss");
+  return 0;
+}
+
+//
+// madvise(): WILLNEED reads a file in without mapping it,
+// SEQUENTIAL scans keep only a few windows mapped, RANDOM
+// faults map one page, but only in the range it was given,
+// and DONTNEED drops private changes.
+//
+void
+madvise_test(void)
+{
+  enum { NPG=64 };
+  struct memstat before, after;
+  const char * const f = "mmap.madvise";
+  int fd, i, j, rss0;
+  char *p;
+
+  printf("madvise_test starting\n");
+  testname = "madvise_test";
+
+  unlink(f);
+  if((fd = open(f, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  for(i = 0; i < NPG; i++){
+    memset(buf, 'a' + i % 26, BSIZE);
+    for(j = 0; j < PGSIZE/BSIZE; j++)
+      if(write(fd, buf, BSIZE) != BSIZE)
+        err("write");
+  }
+
+  p = mmap(0, NPG*PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  if(madvise(p + 1, PGSIZE, MADV_NORMAL) != -1 ||
+     madvise(p, PGSIZE, 99) != -1)
+    err("bad madvise succeeded");
+
+  myrss();  // fault in pm[] first
+  memstat(&before, 0, 0);
+  rss0 = myrss();
+  if(madvise(p, NPG*PGSIZE, MADV_WILLNEED) != 0)
+    err("madvise WILLNEED");
+  memstat(&after, 0, 0);
+  if(after.pages[PG_FILE] < before.pages[PG_FILE] + NPG)
+    err("WILLNEED didn't read the file in");
+  if(myrss() != rss0)
+    err("WILLNEED mapped pages");
+
+  if(madvise(p, NPG*PGSIZE, MADV_SEQUENTIAL) != 0)
+    err("madvise SEQUENTIAL");
+  for(i = 0; i < NPG; i++)
+    if(p[i*PGSIZE] != 'a' + i % 26)
+      err("page mismatch");
+  if(myrss() - rss0 > 2*READAHEAD)
+    err("sequential scan kept its pages");
+  munmap(p, NPG*PGSIZE);
+
+  p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  if(madvise(p + 8*PGSIZE, 8*PGSIZE, MADV_RANDOM) != 0)
+    err("madvise RANDOM");
+  rss0 = myrss();
+  if(p[10*PGSIZE] != 'a' + 10)
+    err("page mismatch");
+  if(myrss() != rss0 + 1)
+    err("RANDOM fault mapped more than its page");
+  if(p[40*PGSIZE] != 'a' + 40 % 26)
+    err("page mismatch");
+  if(myrss() == rss0 + 2)
+    err("RANDOM applied outside its range");
+  rss0 = myrss();
+
+  p[10*PGSIZE] = 'x';
+  if(madvise(p + 10*PGSIZE, PGSIZE, MADV_DONTNEED) != 0)
+    err("madvise DONTNEED");
+  if(myrss() != rss0 - 1)
+    err("DONTNEED left the page mapped");
+  if(p[10*PGSIZE] != 'a' + 10)
+    err("DONTNEED kept the private change");
+
+  munmap(p, NPG*PGSIZE);
+  unlink(f);
+
+  printf("madvise_test OK\n");
+}
+
+//
+// MAP_ANONYMOUS memory reads as zeros and needs no file. A
+// private mapping's changes stay with the process that makes
+// them; a shared one's are seen across fork(), even in pages
+// first touched after it. munmap() gives the memory back.
+// a region may be bigger than all of RAM.
+//
+void
+anon_test(void)
+{
+  enum { NPG=16, BIG=1<<30 };
+  int i, pid, xstatus, rss0, fds[2];
+  char *p, *q;
+
+  printf("anon_test starting\n");
+  testname = "anon_test";
+
+  myrss();
+  rss0 = myrss();
+  p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  q = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED || q == MAP_FAILED)
+    err("mmap");
+  for(i = 0; i < NPG*PGSIZE; i += PGSIZE/4)
+    if(p[i] != 0 || q[i] != 0)
+      err("not zero");
+  for(i = 0; i < NPG; i++)
+    p[i*PGSIZE] = 'p';
+  q[0] = 'q';
+
+  if((pid = fork()) < 0)
+    err("fork");
+  if(pid == 0){
+    if(p[0] != 'p' || q[0] != 'q')
+      exit(1);
+    p[0] = 'c';
+    q[0] = 'c';
+    q[(NPG-1)*PGSIZE] = 'c';   // untouched before fork
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child");
+  if(p[0] != 'p')
+    err("child's private write seen");
+  if(q[0] != 'c' || q[(NPG-1)*PGSIZE] != 'c')
+    err("child's shared write not seen");
+
+  if(munmap(p, NPG*PGSIZE) != 0 || munmap(q, NPG*PGSIZE) != 0)
+    err("munmap");
+  if(myrss() != rss0)
+    err("munmap didn't free the pages");
+
+  // the kernel copies to and from its far end like any page.
+  p = mmap(0, BIG, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(p == MAP_FAILED)
+    err("mmap big");
+  p[BIG-1] = 'z';
+  if(pipe(fds) < 0)
+    err("pipe");
+  if(write(fds[1], p + BIG-1, 1) != 1 || read(fds[0], p, 1) != 1 || p[0] != 'z')
+    err("big region copy");
+  close(fds[0]);
+  close(fds[1]);
+  if(munmap(p, BIG) != 0)
+    err("munmap big");
+  if(myrss() != rss0)
+    err("munmap big didn't free the pages");
+
+  printf("anon_test OK\n");
+}
+
+//
+// mmap() of a window into a file, at an offset, at a hinted
+// or a MAP_FIXED address, and munmap() of a region's middle,
+// which leaves two regions that still fault in their own data.
+//
+void
+window_test(void)
+{
+  enum { NPG=12 };
+  const char * const f = "mmap.window";
+  int fd, i, j;
+  char *p, *q;
+
+  printf("window_test starting\n");
+  testname = "window_test";
+
+  unlink(f);
+  if((fd = open(f, O_RDWR | O_CREATE)) < 0)
+    err("open");
+  for(i = 0; i < NPG; i++){
+    memset(buf, 'a' + i, BSIZE);
+    for(j = 0; j < PGSIZE/BSIZE; j++)
+      if(write(fd, buf, BSIZE) != BSIZE)
+        err("write");
+  }
+
+  if(mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 1) != MAP_FAILED)
+    err("unaligned offset accepted");
+
+  // pages 4..9 of the file.
+  p = mmap(0, 6*PGSIZE, PROT_READ, MAP_PRIVATE, fd, 4*PGSIZE);
+  if(p == MAP_FAILED)
+    err("mmap");
+  for(i = 0; i < 6; i++)
+    if(p[i*PGSIZE] != 'a' + 4 + i)
+      err("window mismatch");
+
+  // a hole in the middle: pages 6 and 7 go.
+  if(munmap(p + 2*PGSIZE, 2*PGSIZE) != 0)
+    err("munmap middle");
+  if(p[PGSIZE] != 'a' + 5 || p[4*PGSIZE] != 'a' + 8 || p[5*PGSIZE] != 'a' + 9)
+    err("split regions mismatch");
+
+  // a hint at the hole is taken.
+  q = mmap(p + 2*PGSIZE, 2*PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(q != p + 2*PGSIZE)
+    err("hint not taken");
+  if(q[0] != 'a' || q[PGSIZE] != 'b')
+    err("hinted mapping mismatch");
+
+  // a hint at a used address is not.
+  q = mmap(p, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(q == MAP_FAILED || q == p)
+    err("used hint taken");
+  munmap(q, PGSIZE);
+
+  // MAP_FIXED replaces pages 1..3 of the window: part of
+  // one region, and all of the hinted one.
+  q = mmap(p + PGSIZE, 3*PGSIZE, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 10*PGSIZE);
+  if(q != p + PGSIZE)
+    err("MAP_FIXED");
+  if(p[0] != 'a' + 4 || q[0] != 'a' + 10 || q[PGSIZE] != 'a' + 11 ||
+     p[4*PGSIZE] != 'a' + 8)
+    err("MAP_FIXED mismatch");
+
+  // one munmap() across all of them.
+  if(munmap(p, 6*PGSIZE) != 0)
+    err("munmap all");
+  if(munmap(p, 6*PGSIZE) != -1)
+    err("munmap of nothing succeeded");
+  close(fd);
+  unlink(f);
+
+  printf("window_test OK\n");
+}
+
+//
+// two processes each read() one file into a mapping of the
+// other, over and over: neither may wait for the other's
+// inode while holding its own.
+//
+void
+cross_test(void)
+{
+  enum { NPG=4, N=50 };
+  const char * const f[2] = { "mmap.cross0", "mmap.cross1" };
+  int fd[2], i, j, k, pid, xstatus;
+  char *p;
+
+  printf("cross_test starting\n");
+  testname = "cross_test";
+
+  for(i = 0; i < 2; i++){
+    unlink(f[i]);
+    if((fd[i] = open(f[i], O_RDWR | O_CREATE)) < 0)
+      err("open");
+    memset(buf, '0' + i, BSIZE);
+    for(j = 0; j < NPG*PGSIZE/BSIZE; j++)
+      if(write(fd[i], buf, BSIZE) != BSIZE)
+        err("write");
+    close(fd[i]);
+  }
+
+  if((pid = fork()) < 0)
+    err("fork");
+  i = pid == 0;   // the child reads f[1] into a mapping of f[0]
+  if((fd[0] = open(f[i], O_RDWR)) < 0 || (fd[1] = open(f[!i], O_RDWR)) < 0)
+    err("open");
+  for(k = 0; k < N; k++){
+    // a fresh mapping each time, so the copy faults.
+    p = mmap(0, NPG*PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd[1], 0);
+    if(p == MAP_FAILED)
+      err("mmap");
+    if(read(fd[0], p, NPG*PGSIZE) != NPG*PGSIZE)
+      err("read");
+    if(p[0] != '0' + i || p[NPG*PGSIZE-1] != '0' + i)
+      err("read mismatch");
+    munmap(p, NPG*PGSIZE);
+    close(fd[0]);
+    if((fd[0] = open(f[i], O_RDWR)) < 0)
+      err("open");
+  }
+  close(fd[0]);
+  close(fd[1]);
+  if(pid == 0)
+    exit(0);
+  wait(&xstatus);
+  if(xstatus != 0)
+    err("child");
+  unlink(f[0]);
+  unlink(f[1]);
+
+  printf("cross_test OK\n");
+}
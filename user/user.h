@@ -1,5 +1,7 @@
 struct stat;
 struct rtcdate;
+struct memstat;
+struct procmem;
 
 // system calls
 int fork(void);
@@ -25,6 +27,9 @@ int sleep(int);
 int uptime(void);
 void *mmap(void *addr, int length, int prot, int flags, int fd, int offset);
 int munmap(void *addr, int length);
+int msync(void *addr, int length);
+int madvise(void *addr, int length, int advice);
+int memstat(struct memstat*, struct procmem*, int);
 
 // ulib.c   
 int stat(const char*, struct stat*);